@@ -0,0 +1,138 @@
+/* HSD_capture.c
+ *
+ * Capture files of the quabo packets received by the net thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "HSD_capture.h"
+
+//pcap file header
+typedef struct pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_header_t;
+
+//pcap record header
+typedef struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_frac;       //ns or us depending on the magic
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_header_t;
+
+/**
+ * Open the file stream with a large buffer.
+ */
+static int capture_fopen(HSD_capture_t *cap, const char *path, const char *mode){
+    memset(cap, 0, sizeof(*cap));
+    cap->fp = fopen(path, mode);
+    if (!cap->fp){
+        hashpipe_error(__FUNCTION__, "unable to open capture file %s", path);
+        return HASHPIPE_ERR_SYS;
+    }
+    cap->p_buf = (char *)malloc(CAPTURE_BUF_SIZE);
+    if (cap->p_buf){
+        setvbuf(cap->fp, cap->p_buf, _IOFBF, CAPTURE_BUF_SIZE);
+    }
+    return HASHPIPE_OK;
+}
+
+int HSD_capture_create(HSD_capture_t *cap, const char *path){
+    pcap_file_header_t header;
+
+    if (capture_fopen(cap, path, "wb") != HASHPIPE_OK){
+        return HASHPIPE_ERR_SYS;
+    }
+    cap->nsec = 1;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = PCAP_MAGIC_NSEC;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.snaplen = CAPTURE_SNAPLEN;
+    header.linktype = PCAP_LINKTYPE_USER0;
+    if (fwrite(&header, sizeof(header), 1, cap->fp) != 1){
+        hashpipe_error(__FUNCTION__, "unable to write capture file header");
+        HSD_capture_close(cap);
+        return HASHPIPE_ERR_SYS;
+    }
+    return HASHPIPE_OK;
+}
+
+int HSD_capture_open(HSD_capture_t *cap, const char *path){
+    pcap_file_header_t header;
+
+    if (capture_fopen(cap, path, "rb") != HASHPIPE_OK){
+        return HASHPIPE_ERR_SYS;
+    }
+    if (fread(&header, sizeof(header), 1, cap->fp) != 1 ||
+        (header.magic != PCAP_MAGIC_NSEC && header.magic != PCAP_MAGIC_USEC)){
+        hashpipe_error(__FUNCTION__, "%s is not a native byte order pcap file", path);
+        HSD_capture_close(cap);
+        return HASHPIPE_ERR_SYS;
+    }
+    cap->nsec = (header.magic == PCAP_MAGIC_NSEC);
+    return HASHPIPE_OK;
+}
+
+int HSD_capture_write(HSD_capture_t *cap, uint64_t recv_ns, const unsigned char *data, unsigned int len){
+    pcap_record_header_t record;
+
+    record.ts_sec = recv_ns / 1000000000ULL;
+    record.ts_frac = recv_ns % 1000000000ULL;
+    record.incl_len = len;
+    record.orig_len = len;
+    if (fwrite(&record, sizeof(record), 1, cap->fp) != 1 ||
+        fwrite(data, 1, len, cap->fp) != len){
+        return HASHPIPE_ERR_SYS;
+    }
+    cap->npkts++;
+    return HASHPIPE_OK;
+}
+
+int HSD_capture_read(HSD_capture_t *cap, uint64_t *recv_ns, unsigned char *buf, unsigned int buf_size, unsigned int *len){
+    pcap_record_header_t record;
+
+    if (fread(&record, sizeof(record), 1, cap->fp) != 1){
+        return feof(cap->fp) ? 0 : -1;
+    }
+    *recv_ns = (uint64_t)record.ts_sec * 1000000000ULL
+                + (uint64_t)record.ts_frac * (cap->nsec ? 1 : 1000);
+
+    *len = (record.incl_len < buf_size) ? record.incl_len : buf_size;
+    if (fread(buf, 1, *len, cap->fp) != *len){
+        return feof(cap->fp) ? 0 : -1;
+    }
+    //Skip the part of the payload that does not fit into the buffer
+    if (record.incl_len > *len && fseek(cap->fp, record.incl_len - *len, SEEK_CUR) != 0){
+        return -1;
+    }
+    cap->npkts++;
+    return 1;
+}
+
+int HSD_capture_rewind(HSD_capture_t *cap){
+    if (fseek(cap->fp, sizeof(pcap_file_header_t), SEEK_SET) != 0){
+        return HASHPIPE_ERR_SYS;
+    }
+    clearerr(cap->fp);
+    return HASHPIPE_OK;
+}
+
+void HSD_capture_close(HSD_capture_t *cap){
+    if (cap->fp){
+        if (fclose(cap->fp) == EOF){
+            printf("Warning: Unable to close capture file.\n");
+        }
+        cap->fp = NULL;
+    }
+    free(cap->p_buf);
+    cap->p_buf = NULL;
+}
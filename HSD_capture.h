@@ -0,0 +1,81 @@
+/* HSD_capture.h
+ *
+ * Capture files of the quabo packets received by the net thread. A capture
+ * file is a pcap file with nanosecond timestamps whose records are the UDP
+ * payloads of the packets (link type USER0) stamped with their receive time.
+ * Standard pcap tools can count, slice and merge the files, and the replay
+ * thread feeds them back into the input buffer.
+ */
+
+#ifndef _HSD_CAPTURE_H
+#define _HSD_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "hashpipe.h"
+
+#define PCAP_MAGIC_USEC         0xa1b2c3d4  //pcap magic with microsecond timestamps
+#define PCAP_MAGIC_NSEC         0xa1b23c4d  //pcap magic with nanosecond timestamps
+#define PCAP_LINKTYPE_USER0     147         //Link type of records without a link layer
+#define CAPTURE_SNAPLEN         65535
+#define CAPTURE_BUF_SIZE        (4*1024*1024)   //Buffer of the capture file stream
+
+/**
+ * Capture file opened for writing or reading.
+ */
+typedef struct HSD_capture {
+    FILE *fp;
+    char *p_buf;            //Buffer of the file stream
+    int nsec;               //Timestamps are in ns instead of us
+    uint64_t npkts;         //Records written or read
+} HSD_capture_t;
+
+/**
+ * Create a capture file and write its pcap header.
+ * @param cap The capture object to be initialized
+ * @param path The path of the file, which is truncated if it exists
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_capture_create(HSD_capture_t *cap, const char *path);
+
+/**
+ * Open a capture file for reading and check its pcap header.
+ * @param cap The capture object to be initialized
+ * @param path The path of the file
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_capture_open(HSD_capture_t *cap, const char *path);
+
+/**
+ * Append a packet to the capture file.
+ * @param cap The capture file
+ * @param recv_ns The receive time of the packet in ns since the epoch
+ * @param data The UDP payload of the packet
+ * @param len The length of the payload
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_capture_write(HSD_capture_t *cap, uint64_t recv_ns, const unsigned char *data, unsigned int len);
+
+/**
+ * Read the next packet of the capture file. Payloads longer than the buffer
+ * are truncated.
+ * @param cap The capture file
+ * @param recv_ns Set to the receive time of the packet in ns since the epoch
+ * @param buf The buffer the payload is read into
+ * @param buf_size The size of the buffer
+ * @param len Set to the length of the payload in the buffer
+ * @return 1 if a packet was read, 0 at the end of the file and -1 on error
+ */
+int HSD_capture_read(HSD_capture_t *cap, uint64_t *recv_ns, unsigned char *buf, unsigned int buf_size, unsigned int *len);
+
+/**
+ * Go back to the first packet of a capture file opened for reading.
+ */
+int HSD_capture_rewind(HSD_capture_t *cap);
+
+/**
+ * Flush and close the capture file.
+ */
+void HSD_capture_close(HSD_capture_t *cap);
+
+#endif
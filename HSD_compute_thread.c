@@ -6,68 +6,195 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
 #include "hashpipe.h"
 #include "HSD_databuf.h"
+#include "HSD_topology.h"
+#include "HSD_pixstats.h"
 
 
 #define NUM_OF_MODES 7 // Number of mode and also used the create the size of array (Modes 1,2,3,6,7)
+#define COMPUTE_MAX_WORKERS 16 // Max number of compute workers assembling module pairs (COMPWRKS)
+#define ASM_MAX_WINDOW 8 // Max number of frames in flight per imaging mode of a module pair (ASMWIN)
+#define ASM_SLOT_16BIT 0 // Assembly slot of the 16 bit imaging modes (acqmode 2,3)
+#define ASM_SLOT_8BIT 1 // Assembly slot of the 8 bit imaging modes (acqmode 6,7)
+#define ASM_N_SLOTS 2
+#define PAIR_COMPLETE 0xff // Status of a frame with the packets of all PKTPERPAIR quabos
+
+//Assembly kernels of the acqmodes, the imaging kernels are the bit depth of the mode
+#define KERNEL_NONE 0
+#define KERNEL_PH 1
+#define KERNEL_8BIT 8
+#define KERNEL_16BIT 16
+#define TRIGGER_MIN_BASELINE 64 // Packets in the trigger baseline of a quabo before it can fire the transient trigger
+#define TRIGGER_BASELINE_PACKETS 1024 // Packets the trigger baseline of a quabo is averaged over
 //#define TEST_MODE
 
 
 /**
- * The module ID structure that is used to store a lot of the information regarding the current pair of module.
- * Module pairs consists of PKTPERPAIR(8) quabos.
+ * Where the packets of a frame are stored, either its record in the output block or the local copy of the frame.
  */
-typedef struct modulePairData {
+typedef struct frameRecord {
+    uint16_t* PKTNUM;
+    uint32_t* NANOSEC;
+    long int* tv_sec;
+    long int* tv_usec;
+    uint8_t* data;
+} frameRecord_t;
+
+/**
+ * A frame of a module pair that is assembled from the packets of its PKTPERPAIR(8) quabos.
+ * The packets are stored straight into a record of the output block that is reserved when the frame is
+ * started. A frame that is still in flight when the block is passed on, or that found the block full,
+ * is kept in the local copy and written to the output block when it is done.
+ */
+typedef struct modulePairFrame {
     uint8_t status;   // Determine the which part of the data is filled 0:neither filled 1:First rank filled 2: Second rank filled
-    unsigned int mod1Name;
-    unsigned int mod2Name;
     uint32_t upperNANOSEC;
     uint32_t lowerNANOSEC;
     int lastMode;
+    uint64_t opened_ns;     // Monotonic time the frame was started
+    int out_index;          // Record of the frame in the current output block or -1 for the local copy
+    uint8_t trigger;        // Set when a packet of the frame fired the transient trigger
+    frameRecord_t rec;      // Where the packets are stored
+    //Local copy of the frame
     uint16_t PKTNUM[PKTPERPAIR];
     uint32_t NANOSEC[PKTPERPAIR];
     long int tv_sec[PKTPERPAIR];
     long int tv_usec[PKTPERPAIR];
     uint8_t data[MODPAIRDATASIZE];
-    modulePairData* next_moduleID;
+} modulePairFrame_t;
+
+/**
+ * The frames of a module pair that are assembled for one imaging mode.
+ * Up to ASMWIN frames are assembled at a time so late or reordered packets still find their frame.
+ */
+typedef struct modeSlot {
+    int n_frames;       // Number of frames in flight
+    int order[ASM_MAX_WINDOW];  // Frames in flight from oldest to newest followed by the free frames
+    modulePairFrame_t frame[ASM_MAX_WINDOW];
+} modeSlot_t;
+
+/**
+ * The PH packets of a module pair that are grouped into a coincidence event. A group is open from its first
+ * packet until a packet falls outside its window or comes from a quabo that is already in the group.
+ */
+typedef struct phGroup {
+    int n_events;           // Number of PH packets in the group, 0 when no group is open
+    uint8_t quabos;         // Quabos of the pair in the group, one bit per quabo like the frame status
+    uint64_t first_ns;      // Earliest and latest packet time of the group from pktUTC and pktNSEC
+    uint64_t last_ns;
+    uint64_t opened_ns;     // Monotonic time the group was opened
+    uint16_t PKTNUM[PKTPERPAIR];
+} phGroup_t;
+
+/**
+ * The module ID structure that is used to store a lot of the information regarding the current pair of module.
+ * The 16 bit and 8 bit imaging modes have their own slot, so interleaved modes do not flush each other's frames.
+ */
+typedef struct modulePairData {
+    unsigned int mod1Name;
+    unsigned int mod2Name;
+    int worker;         // The compute worker that assembles this module pair
+    int n_frames;       // Number of frames in flight in all slots, saves looking into the slots of idle pairs
+    modeSlot_t slot[ASM_N_SLOTS];
+    phGroup_t ph;       // The open PH coincidence group
 } modulePairData_t;
 
 /**
- * Creating a new module ID object given the ID values and module numbers.
+ * Baseline of the pixels of a quabo for the transient trigger. It is an exponential moving average
+ * over about TRIGGER_BASELINE_PACKETS packets, so it follows slow changes of the sky and of the gain.
+ * It is kept apart from the pixel statistics so the rollover of PixelStats does not reset it.
  */
-modulePairData_t* modulePairData_t_new(unsigned int mod1, unsigned int mod2){
-    modulePairData_t* value = (modulePairData_t*) malloc(sizeof(struct modulePairData));
-    if (value == NULL){
-        printf("Error: Unable to malloc space for ModulePairData\n");
-        exit(1);
-    }
-    value->status = 0;
-    value->mod1Name = mod1;
-    value->mod2Name = mod2;
-    value->next_moduleID = NULL;
-    value->upperNANOSEC = 0;
-    value->lowerNANOSEC = 0;
-    return value;
+typedef struct triggerBaseline {
+    float mean[SCIDATASIZE];
+    float var[SCIDATASIZE];
+    uint64_t n;             // Packets added to the baseline
+} __attribute__((aligned(CACHE_ALIGNMENT))) triggerBaseline_t;
+
+//The module pairs of the config file and their assembly state indexed by module pair index
+static const HSD_topology_t* topo;
+static modulePairData_t* modulePairs;
+
+//Number of frames in flight per module pair. 1 writes a frame out as soon as a packet does not fit in it.
+static int asm_window = 1;
+
+//Age in ns after which a frame in flight is written out even if it is not complete, 0 for never
+static uint64_t asm_max_age_ns = 1000000000ULL;
+
+//Frames written out because of their age and frames lost because the output block was full
+static uint64_t asm_stale_frames = 0;
+static uint64_t asm_lost_frames = 0;
+
+//Running pixel statistics of the quabos or NULL when they are not kept, published every PIXSTINT ms
+static HSD_pixstats_t* pixstats = NULL;
+static uint64_t pixstats_interval_ns = 1000000000ULL;
+static uint64_t pixstats_next_ns = 0;      // Time the pixel statistics are published next
+
+//Every PIXSTDEC-th packet of a quabo is added to its pixel statistics
+static int pixstats_decimation = 1;
+
+//A frame fires the transient trigger when a packet has TRIGPIX pixels more than TRIGSIG sigma above the
+//baseline of its quabo. 0 pixels disables the trigger.
+static int trigger_pixels = 0;
+static float trigger_k2 = 25.0f;
+
+//Trigger baselines of the quabos per imaging slot, NULL when the trigger is disabled
+static triggerBaseline_t* trigger_baselines[ASM_N_SLOTS] = {NULL, NULL};
+
+//PH packets of different quabos of a module pair within PHCWIN ns of each other are grouped into a
+//coincidence event. Events with fewer than PHCMIN packets are dropped. 0 ns disables the grouping.
+static uint64_t ph_window_ns = 0;
+static int ph_min_multiplicity = 2;
+
+//PH coincidence events lost because the output block was full
+static uint64_t ph_lost_events = 0;
+
+/**
+ * Read the monotonic clock in ns.
+ */
+static inline uint64_t monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /**
- * Creating a new module ID with zeroed/null values
+ * Point the frame record at the local copy of the frame.
  */
-modulePairData_t* modulePairData_t_new(){
-    return modulePairData_t_new(-1,-1);
+static inline void recordLocal(modulePairFrame_t* frame){
+    frame->rec.PKTNUM = frame->PKTNUM;
+    frame->rec.NANOSEC = frame->NANOSEC;
+    frame->rec.tv_sec = frame->tv_sec;
+    frame->rec.tv_usec = frame->tv_usec;
+    frame->rec.data = frame->data;
 }
 
 /**
- * Creating a new module ID with only 1 module for when new module is detected and not in module pair config file
+ * Initializing a module pair object given the module numbers.
  */
-modulePairData_t* modulePairData_t_new(unsigned mod1){
-    return modulePairData_t_new(mod1, -1);
+void modulePairData_init(modulePairData_t* value, unsigned int mod1, unsigned int mod2){
+    value->mod1Name = mod1;
+    value->mod2Name = mod2;
+    value->worker = 0;
+    value->n_frames = 0;
+    for (int s = 0; s < ASM_N_SLOTS; s++){
+        modeSlot_t* slot = &(value->slot[s]);
+        slot->n_frames = 0;
+        for (int i = 0; i < ASM_MAX_WINDOW; i++){
+            slot->order[i] = i;
+            slot->frame[i].status = 0;
+            slot->frame[i].out_index = -1;
+            recordLocal(&(slot->frame[i]));
+        }
+    }
+    value->ph.n_events = 0;
 }
 
 /**
@@ -90,83 +217,398 @@ modulePairData_t* modulePairData_t_new(unsigned mod1){
 }*/
 
 /**
- * Writes the module pair data to output buffer
+ * Split the receive time of a packet in ns into the tv_sec and tv_usec stored in the output buffer.
+ */
+static inline void recvTimeToTimeval(uint64_t recvTime, long int* tv_sec, long int* tv_usec){
+    *tv_sec = recvTime / 1000000000ULL;
+    *tv_usec = (recvTime % 1000000000ULL) / 1000;
+}
+
+/**
+ * Reserve a module pair record and its data in the output block. The compute workers share the output block.
+ * The record holds no frame (status 0) until the frame is written to it.
+ * @return The index of the record or -1 if the output block is full
  */
-void writeDataToOutBuf(modulePairData_t* modulePair, HSD_output_block_t* out_block){
-    int out_index = out_block->header.stream_block_size;
+static int reserveRecord(modulePairData_t* modulePair, HSD_output_block_t* out_block, int mode){
     HSD_output_block_header_t* out_header = &(out_block->header);
+    unsigned int data_size = HSD_modpair_data_size(mode);
+
+    int out_index = __atomic_load_n(&(out_header->stream_block_size), __ATOMIC_RELAXED);
+    do {
+        if (out_index >= OUT_MODPAIR_PER_BLOCK){
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&(out_header->stream_block_size), &out_index, out_index + 1,
+                                          1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    uint32_t data_offset = __atomic_fetch_add(&(out_header->stream_data_size), data_size, __ATOMIC_RELAXED);
 
     out_header->modNum[out_index*2] = modulePair->mod1Name;
     out_header->modNum[(out_index*2)+1] = modulePair->mod2Name;
+    out_header->acqmode[out_index] = mode;
+    out_header->status[out_index] = 0;
+    out_header->trigger[out_index] = 0;
 
-    out_header->acqmode[out_index] = modulePair->lastMode;
-    
-    memcpy(out_block->header.pktNum + (out_index * PKTPERPAIR), modulePair->PKTNUM, sizeof(modulePair->PKTNUM[0])*PKTPERPAIR);
-    memcpy(out_block->header.pktNSEC + (out_index * PKTPERPAIR), modulePair->NANOSEC, sizeof(modulePair->NANOSEC[0])*PKTPERPAIR);
-    memcpy(out_block->header.tv_sec + (out_index * PKTPERPAIR), modulePair->tv_sec, sizeof(modulePair->tv_sec[0])*PKTPERPAIR);
-    memcpy(out_block->header.tv_usec + (out_index * PKTPERPAIR), modulePair->tv_usec, sizeof(modulePair->tv_usec[0])*PKTPERPAIR);
-    memcpy(out_block->header.status + out_index, &(modulePair->status), sizeof(modulePair->status));
-    
-    memcpy(out_block->stream_block + (out_index * MODPAIRDATASIZE), modulePair->data, sizeof(uint8_t)*MODPAIRDATASIZE);
+    //Pack the frame at its real size, 8 bit frames only use the first half of the data
+    out_header->stream_offset[out_index] = data_offset;
+    return out_index;
+}
 
-    out_block->header.stream_block_size++;
+/**
+ * Point the frame record at a record of the output block.
+ */
+static inline void recordInBlock(frameRecord_t* rec, HSD_output_block_t* out_block, int out_index){
+    rec->PKTNUM = out_block->header.pktNum + (out_index * PKTPERPAIR);
+    rec->NANOSEC = out_block->header.pktNSEC + (out_index * PKTPERPAIR);
+    rec->tv_sec = out_block->header.tv_sec + (out_index * PKTPERPAIR);
+    rec->tv_usec = out_block->header.tv_usec + (out_index * PKTPERPAIR);
+    rec->data = (uint8_t*)HSD_output_stream_record(out_block, out_index);
 }
 
 /**
- * Write PH Data to output buffer's coinc block
+ * Copy a frame record.
  */
-void writePHToOutBuf(HSD_input_block_t* in_block, int pktIndex, HSD_output_block_t* out_block){
-    int out_index = out_block->header.coinc_block_size;
-    out_block->header.coin_acqmode[out_index] = in_block->header.acqmode[pktIndex];
-    out_block->header.coin_pktNum[out_index] = in_block->header.pktNum[pktIndex];
-    out_block->header.coin_modNum[out_index] = in_block->header.modNum[pktIndex];
-    out_block->header.coin_quaNum[out_index] = in_block->header.quaNum[pktIndex];
-    out_block->header.coin_pktUTC[out_index] = in_block->header.pktUTC[pktIndex];
-    out_block->header.coin_pktNSEC[out_index] = in_block->header.pktNSEC[pktIndex];
-    out_block->header.coin_tv_sec[out_index] = in_block->header.tv_sec[pktIndex];
-    out_block->header.coin_tv_usec[out_index] = in_block->header.tv_usec[pktIndex];
-    
-    memcpy(out_block->coinc_block + out_index*PKTDATASIZE, in_block->data_block + pktIndex*PKTDATASIZE, sizeof(in_block->data_block[0])*PKTDATASIZE);
+static inline void copyRecord(frameRecord_t* dst, const frameRecord_t* src, int mode){
+    memcpy(dst->PKTNUM, src->PKTNUM, sizeof(src->PKTNUM[0])*PKTPERPAIR);
+    memcpy(dst->NANOSEC, src->NANOSEC, sizeof(src->NANOSEC[0])*PKTPERPAIR);
+    memcpy(dst->tv_sec, src->tv_sec, sizeof(src->tv_sec[0])*PKTPERPAIR);
+    memcpy(dst->tv_usec, src->tv_usec, sizeof(src->tv_usec[0])*PKTPERPAIR);
+    memcpy(dst->data, src->data, sizeof(uint8_t)*HSD_modpair_data_size(mode));
+}
 
-    out_block->header.coinc_block_size++;
+/**
+ * Zero the quabos of the frame that have no packet, as the record may hold an older frame.
+ */
+static void clearMissingQuabos(modulePairFrame_t* frame){
+    unsigned int quabo_size = SCIDATASIZE*(frame->lastMode/8);
+    for (int i = 0; i < PKTPERPAIR; i++){
+        if (frame->status & (0x01 << i)){
+            continue;
+        }
+        frame->rec.PKTNUM[i] = 0;
+        frame->rec.NANOSEC[i] = 0;
+        frame->rec.tv_sec[i] = 0;
+        frame->rec.tv_usec[i] = 0;
+        memset(frame->rec.data + i*quabo_size, 0, quabo_size);
+    }
 }
 
+/**
+ * Writes the module pair data to output buffer. A frame assembled in the output block only has its status
+ * set, while a frame kept in the local copy is copied to a new record.
+ * @return 0 on success or -1 if the output block is full
+ */
+int writeDataToOutBuf(modulePairData_t* modulePair, modulePairFrame_t* frame, HSD_output_block_t* out_block){
+    int out_index = frame->out_index;
+    clearMissingQuabos(frame);
+    if (out_index < 0){
+        out_index = reserveRecord(modulePair, out_block, frame->lastMode);
+        if (out_index < 0){
+            return -1;
+        }
+        frameRecord_t rec;
+        recordInBlock(&rec, out_block, out_index);
+        copyRecord(&rec, &(frame->rec), frame->lastMode);
+    }
+    out_block->header.trigger[out_index] = frame->trigger;
+    out_block->header.status[out_index] = frame->status;
+    return 0;
+}
 
 /**
- * Storing the module data to the modulePairData from the data pointer.
+ * Move a frame that is assembled in the output block to its local copy before the block is passed on.
+ * The record in the block is left without a frame and is removed by compactOutputBlock.
  */
-void storeData(modulePairData_t* module, HSD_input_block_t* in_block, HSD_output_block_t* out_block, int pktIndex){
-    int mode;
-    int quaboIndex;
-    char acqmode = in_block->header.acqmode[pktIndex];
-    uint16_t modNum = in_block->header.modNum[pktIndex];
-    uint8_t quaboNum = in_block->header.quaNum[pktIndex];
-    uint16_t PKTNUM = in_block->header.pktNum[pktIndex];
-    uint32_t NANOSEC = in_block->header.pktNSEC[pktIndex];
+static void detachFrame(modulePairFrame_t* frame, HSD_output_block_t* out_block){
+    if (frame->out_index < 0){
+        return;
+    }
+    frameRecord_t rec = frame->rec;
+    recordLocal(frame);
+    copyRecord(&(frame->rec), &rec, frame->lastMode);
+    out_block->header.status[frame->out_index] = 0;
+    frame->out_index = -1;
+}
 
-    uint8_t currentStatus = (0x01 << quaboNum);
+/**
+ * Start a new frame of the slot as its newest frame in flight. The frame is assembled in a new record of
+ * the output block or in its local copy if the block is full.
+ */
+static modulePairFrame_t* openFrame(modulePairData_t* module, modeSlot_t* slot, int mode, uint32_t NANOSEC, HSD_output_block_t* out_block){
+    modulePairFrame_t* frame = &(slot->frame[slot->order[slot->n_frames]]);
+    slot->n_frames++;
+    module->n_frames++;
+
+    frame->out_index = reserveRecord(module, out_block, mode);
+    if (frame->out_index < 0){
+        recordLocal(frame);
+    } else {
+        recordInBlock(&(frame->rec), out_block, frame->out_index);
+    }
 
-    //Check the acqmode to determine the mode in which the packet is coming in as
+    frame->status = 0;
+    frame->trigger = 0;
+    frame->lastMode = mode;
+    frame->upperNANOSEC = NANOSEC;
+    frame->lowerNANOSEC = NANOSEC;
+    frame->opened_ns = monotonic_ns();
+    return frame;
+}
+
+/**
+ * Free the frame in flight at the given position.
+ * @param pos The position of the frame from the oldest (0) to the newest frame in flight
+ */
+static void removeFrame(modulePairData_t* module, modeSlot_t* slot, int pos){
+    int index = slot->order[pos];
+    for (int i = pos; i < slot->n_frames - 1; i++){
+        slot->order[i] = slot->order[i + 1];
+    }
+    slot->n_frames--;
+    slot->order[slot->n_frames] = index;
+    module->n_frames--;
+}
+
+/**
+ * Write the frame in flight at the given position out to the output block and free it.
+ * The frame stays in flight if the output block is full.
+ * @param pos The position of the frame from the oldest (0) to the newest frame in flight
+ * @return 0 on success or -1 if the output block is full
+ */
+static int emitFrame(modulePairData_t* module, modeSlot_t* slot, int pos, HSD_output_block_t* out_block){
+    if (writeDataToOutBuf(module, &(slot->frame[slot->order[pos]]), out_block) != 0){
+        return -1;
+    }
+    removeFrame(module, slot, pos);
+    return 0;
+}
+
+/**
+ * Move the frames in flight of the module pair that are assembled in the output block to their local copy.
+ */
+static void detachPair(modulePairData_t* module, HSD_output_block_t* out_block){
+    for (int s = 0; s < ASM_N_SLOTS && module->n_frames > 0; s++){
+        modeSlot_t* slot = &(module->slot[s]);
+        for (int pos = 0; pos < slot->n_frames; pos++){
+            detachFrame(&(slot->frame[slot->order[pos]]), out_block);
+        }
+    }
+}
+
+/**
+ * Check if the oldest frame in flight of the slot was started before the given time.
+ */
+static inline int slotStale(const modeSlot_t* slot, uint64_t opened_before_ns){
+    return slot->n_frames > 0 && slot->frame[slot->order[0]].opened_ns < opened_before_ns;
+}
+
+/**
+ * Write the open PH coincidence group of the module pair to the output block as an event and close it.
+ * Groups with fewer than PHCMIN packets are dropped.
+ * @return 0 on success and -1 if the event was lost because the output block is full
+ */
+static int emitPHEvent(modulePairData_t* module, HSD_output_block_t* out_block){
+    HSD_output_block_header_t* out_header = &(out_block->header);
+    phGroup_t* group = &(module->ph);
+    int n_events = group->n_events;
+    group->n_events = 0;
+    if (n_events < ph_min_multiplicity){
+        return 0;
+    }
+
+    int out_index = __atomic_load_n(&(out_header->phe_block_size), __ATOMIC_RELAXED);
+    do {
+        if (out_index >= PH_EVENT_PER_BLOCK){
+            __atomic_add_fetch(&ph_lost_events, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&(out_header->phe_block_size), &out_index, out_index + 1,
+                                          1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    out_header->phe_modNum[out_index*2] = module->mod1Name;
+    out_header->phe_modNum[(out_index*2)+1] = module->mod2Name;
+    out_header->phe_multiplicity[out_index] = n_events;
+    out_header->phe_quabos[out_index] = group->quabos;
+    out_header->phe_pktUTC[out_index] = group->first_ns / 1000000000ULL;
+    out_header->phe_pktNSEC[out_index] = group->first_ns % 1000000000ULL;
+    out_header->phe_span[out_index] = group->last_ns - group->first_ns;
+    memcpy(out_header->phe_pktNum + (out_index*PKTPERPAIR), group->PKTNUM, sizeof(group->PKTNUM));
+    return 0;
+}
+
+/**
+ * Add a PH packet to the open coincidence group of its module pair. This is a streaming join on pktUTC
+ * and pktNSEC: the group is written out and a new one is opened when the packet does not fit in the
+ * window of the group or its quabo is already in it, so each packet is only compared with one group.
+ */
+static void addPHEvent(modulePairData_t* module, const HSD_pkt_desc_t* desc, HSD_output_block_t* out_block){
+    phGroup_t* group = &(module->ph);
+    uint64_t pkt_ns = (uint64_t)desc->pktUTC * 1000000000ULL + desc->pktNSEC;
+    int quaboIndex = HSD_pkt_quanum(desc);
+    if (HSD_pkt_modnum(desc) == module->mod2Name){
+        quaboIndex += 4;
+    }
+    uint8_t currentStatus = (0x01 << quaboIndex);
+
+    if (group->n_events > 0){
+        uint64_t first_ns = (pkt_ns < group->first_ns) ? pkt_ns : group->first_ns;
+        uint64_t last_ns = (pkt_ns > group->last_ns) ? pkt_ns : group->last_ns;
+        if ((group->quabos & currentStatus) || (last_ns - first_ns) > ph_window_ns){
+            emitPHEvent(module, out_block);
+        } else {
+            group->first_ns = first_ns;
+            group->last_ns = last_ns;
+        }
+    }
+    if (group->n_events == 0){
+        group->quabos = 0;
+        group->first_ns = pkt_ns;
+        group->last_ns = pkt_ns;
+        group->opened_ns = monotonic_ns();
+        memset(group->PKTNUM, 0, sizeof(group->PKTNUM));
+    }
+
+    group->n_events++;
+    group->quabos |= currentStatus;
+    group->PKTNUM[quaboIndex] = desc->pktNum;
+
+    //No other packet can join once all quabos of the pair are in the group
+    if (group->quabos == PAIR_COMPLETE){
+        emitPHEvent(module, out_block);
+    }
+}
+
+/**
+ * Check if the open PH coincidence group of the module pair was opened before the given time.
+ */
+static inline int phGroupStale(const modulePairData_t* module, uint64_t opened_before_ns){
+    return module->ph.n_events > 0 && module->ph.opened_ns < opened_before_ns;
+}
+
+/**
+ * Write out the frames of the module pair that were started before the given time,
+ * oldest first within each slot, until the output block is full.
+ * The PH coincidence group of the pair is written out too when it is that old.
+ * @return The number of frames written out
+ */
+static int flushPair(modulePairData_t* module, uint64_t opened_before_ns, HSD_output_block_t* out_block){
+    int n = 0;
+    if (phGroupStale(module, opened_before_ns)){
+        emitPHEvent(module, out_block);
+    }
+    for (int s = 0; s < ASM_N_SLOTS && module->n_frames > 0; s++){
+        modeSlot_t* slot = &(module->slot[s]);
+        while (slotStale(slot, opened_before_ns)){
+            if (emitFrame(module, slot, 0, out_block) != 0){
+                return n;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * Write PH Data to output buffer's coinc block
+ * @tparam DATA_SIZE The data size of the PH packets or 0 to take it from the acqmode of the packet
+ */
+template<unsigned int DATA_SIZE>
+void writePHToOutBuf(HSD_input_block_t* in_block, int pktIndex, HSD_output_block_t* out_block){
+    const HSD_pkt_desc_t* desc = &(in_block->header.pkt[pktIndex]);
+    const unsigned int data_size = DATA_SIZE ? DATA_SIZE : HSD_packet_size(desc->acqmode) - HEADERSIZE;
+
+    //Reserve the record and its data, the compute workers share the output block
+    int out_index = __atomic_fetch_add(&(out_block->header.coinc_block_size), 1, __ATOMIC_RELAXED);
+    uint32_t data_offset = __atomic_fetch_add(&(out_block->header.coinc_data_size), data_size, __ATOMIC_RELAXED);
+
+    out_block->header.coin_acqmode[out_index] = desc->acqmode;
+    out_block->header.coin_pktNum[out_index] = desc->pktNum;
+    out_block->header.coin_modNum[out_index] = HSD_pkt_modnum(desc);
+    out_block->header.coin_quaNum[out_index] = HSD_pkt_quanum(desc);
+    out_block->header.coin_pktUTC[out_index] = desc->pktUTC;
+    out_block->header.coin_pktNSEC[out_index] = desc->pktNSEC;
+    recvTimeToTimeval(desc->recvTime, out_block->header.coin_tv_sec + out_index,
+                        out_block->header.coin_tv_usec + out_index);
+    
+    //Pack the PH packet at the data size of its acqmode
+    out_block->header.coin_offset[out_index] = data_offset;
+    memcpy(out_block->coinc_block + data_offset, in_block->data_block + pktIndex*PKTDATASIZE, sizeof(in_block->data_block[0])*data_size);
+}
+
+
+/**
+ * Assembly kernel of an acqmode.
+ */
+static inline int kernelOf(char acqmode){
     if (acqmode == 0x1){
         //PH Mode
-        //TODO
-        writePHToOutBuf(in_block, pktIndex, out_block);
-        //writePHData(moduleNum, quaboNum, PKTNUM, UTC, NANOSEC, tv_sec, tv_usec, data_ptr);
-        //return;
-    } else if(acqmode == 0x2 || acqmode == 0x3){
+        return KERNEL_PH;
+    } else if (acqmode == 0x2 || acqmode == 0x3){
         //16 bit Imaging mode
-        mode = 16;
+        return KERNEL_16BIT;
     } else if (acqmode == 0x6 || acqmode == 0x7){
         //8 bit Imaging mode
-        mode = 8;
-    } else {
-        //Unidentified mode
-        //Return and not store the packet and return an error
-        printf("A new mode was identify acqmode=%X\n", acqmode);
-        printf("moduleNum=%X quaboNum=%X PKTNUM=%X\n", modNum, quaboNum, PKTNUM);
-        printf("packet skipped\n");
-        return;
+        return KERNEL_8BIT;
+    }
+    return KERNEL_NONE;
+}
+
+/**
+ * Count the pixels of a packet that are above the trigger baseline of their quabo by more than
+ * TRIGSIG standard deviations.
+ */
+template<typename PIXEL>
+static inline int triggerCount(const triggerBaseline_t* b, const PIXEL* __restrict pixels){
+    const float* __restrict mean = b->mean;
+    const float* __restrict var = b->var;
+    int count = 0;
+    for (int i = 0; i < SCIDATASIZE; i++){
+        float delta = pixels[i] - mean[i];
+        count += (delta > 0.0f) & (delta * delta > trigger_k2 * var[i]);
+    }
+    return count;
+}
+
+/**
+ * Add a packet to the trigger baseline of its quabo. The first packets are averaged evenly
+ * until the baseline spans TRIGGER_BASELINE_PACKETS packets.
+ * @param clip Clip the pixels to TRIGSIG standard deviations from the baseline, for the packets that
+ * fire. A transient then barely moves the baseline while a lasting step is taken in after a while.
+ */
+template<typename PIXEL>
+static inline void triggerUpdate(triggerBaseline_t* b, const PIXEL* __restrict pixels, int clip){
+    float* __restrict mean = b->mean;
+    float* __restrict var = b->var;
+    b->n++;
+    const float alpha = (b->n < TRIGGER_BASELINE_PACKETS) ? 1.0f / b->n : 1.0f / TRIGGER_BASELINE_PACKETS;
+    for (int i = 0; i < SCIDATASIZE; i++){
+        float delta = pixels[i] - mean[i];
+        if (clip){
+            float limit = sqrtf(trigger_k2 * var[i]);
+            delta = fminf(fmaxf(delta, -limit), limit);
+        }
+        mean[i] += alpha * delta;
+        var[i] = (1.0f - alpha) * (var[i] + alpha * delta * delta);
     }
+}
+
+/**
+ * Storing the data of an imaging packet into its frame of the module pair.
+ * @tparam MODE The bit depth of the packets (16 or 8) or 0 to take it from the mode argument.
+ * The specialized kernels copy a fixed size the compiler can unroll.
+ */
+template<int MODE>
+static inline void storeImaging(modulePairData_t* module, HSD_input_block_t* in_block, HSD_output_block_t* out_block, int pktIndex, int runMode = MODE){
+    const int mode = MODE ? MODE : runMode;
+    const unsigned int quabo_size = SCIDATASIZE*(mode/8);
+    int quaboIndex;
+    const HSD_pkt_desc_t* desc = &(in_block->header.pkt[pktIndex]);
+    uint16_t modNum = HSD_pkt_modnum(desc);
+    uint8_t quaboNum = HSD_pkt_quanum(desc);
+    uint16_t PKTNUM = desc->pktNum;
+    uint32_t NANOSEC = desc->pktNSEC;
+    modeSlot_t* slot = &(module->slot[(mode == 16) ? ASM_SLOT_16BIT : ASM_SLOT_8BIT]);
+
+    uint8_t currentStatus = (0x01 << quaboNum);
 
     //Set the Index where the packet would be stored within the module pair
     quaboIndex = quaboNum;
@@ -176,52 +618,123 @@ void storeData(modulePairData_t* module, HSD_input_block_t* in_block, HSD_output
         quaboIndex += 4;
     }
 
-    //Setting the upper and lower bounds of NANOSEC interval that is allowed in the grouping
-    if(module->status == 0){
-        //Empty module pair obj
-        //Setting both the upper and lower NANOSEC interval to the current NANOSEC value
-        module->lastMode = mode;
-        module->upperNANOSEC = NANOSEC;
-        module->lowerNANOSEC = NANOSEC;
-    } else if(NANOSEC > module->upperNANOSEC){
-        module->upperNANOSEC = NANOSEC;
-    } else if (NANOSEC < module->lowerNANOSEC){
-        module->lowerNANOSEC = NANOSEC;
+    //Find the frame in flight of the mode's slot the packet belongs to.
+    //Conditions:
+    //The location of the quabo in the frame is not occupied
+    //The NANOSEC interval of the frame with the packet stays within the threshold that is allowed
+    modulePairFrame_t* frame = NULL;
+    int pos;
+    for (pos = 0; pos < slot->n_frames; pos++){
+        modulePairFrame_t* candidate = &(slot->frame[slot->order[pos]]);
+        uint32_t upperNANOSEC = (NANOSEC > candidate->upperNANOSEC) ? NANOSEC : candidate->upperNANOSEC;
+        uint32_t lowerNANOSEC = (NANOSEC < candidate->lowerNANOSEC) ? NANOSEC : candidate->lowerNANOSEC;
+        if (!(candidate->status & currentStatus) && (upperNANOSEC - lowerNANOSEC) <= NANOSECTHRESHOLD){
+            frame = candidate;
+            break;
+        }
     }
 
-    //Check conditions to see if they are met for writing to file
-    //Conditions:
-    //When the current location in module pair is occupied in the module pair
-    //When the mode in the module pair doesen't match the new mode
-    //When the NANOSEC interval superceeded the threshold that is allowed
-    if ((module->status & currentStatus) || module->lastMode != mode || (module->upperNANOSEC - module->lowerNANOSEC) > NANOSECTHRESHOLD){
+    //Start a new frame when none matches. The oldest frame is written out when the window is full.
+    if (frame == NULL){
+        if (slot->n_frames >= asm_window && emitFrame(module, slot, 0, out_block) != 0){
+            //The output block is full of flushed frames, so the oldest frame is lost
+            removeFrame(module, slot, 0);
+            __atomic_add_fetch(&asm_lost_frames, 1, __ATOMIC_RELAXED);
+        }
+        pos = slot->n_frames;
+        frame = openFrame(module, slot, mode, NANOSEC, out_block);
+    }
 
-        writeDataToOutBuf(module, out_block);
+    //Setting the upper and lower bounds of NANOSEC interval of the frame
+    if(NANOSEC > frame->upperNANOSEC){
+        frame->upperNANOSEC = NANOSEC;
+    } else if (NANOSEC < frame->lowerNANOSEC){
+        frame->lowerNANOSEC = NANOSEC;
+    }
 
-        memset(module->PKTNUM, 0, sizeof(uint16_t)*PKTPERPAIR);
-        memset(module->NANOSEC, 0, sizeof(uint32_t)*PKTPERPAIR);
-        memset(module->tv_sec, 0 , sizeof(long)*PKTPERPAIR);
-        memset(module->tv_usec, 0, sizeof(long)*PKTPERPAIR); 
-        
-        //Resetting values in the new emptied module pair obj
-        module->status = 0;
-        module->lastMode = mode;
-        module->upperNANOSEC = NANOSEC;
-        module->lowerNANOSEC = NANOSEC;
-    }
-
-    //printf("ACQMode = %u, LastMode = %u, Mode = %u, ModuleNum = %u, QuaboNum = %u, UTC = %u, NANOSEC = %u, PKTNUM = %u\n", acqmode, module->lastMode, mode, moduleNum, quaboNum, UTC, NANOSEC, PKTNUM);
-    //storePktDataIntoModPair((uint8_t *)module->data, data_ptr, mode, quaboIndex);
-    memcpy(module->data + (quaboIndex*SCIDATASIZE*(mode/8)), in_block->data_block + (pktIndex*PKTDATASIZE), sizeof(uint8_t)*SCIDATASIZE*(mode/8));
-    module->lastMode = mode;
-    module->PKTNUM[quaboIndex] = PKTNUM;
-    //module->UTC[quaboIndex] = UTC;
-    module->tv_sec[quaboIndex] = in_block->header.tv_sec[pktIndex];
-    module->tv_usec[quaboIndex] = in_block->header.tv_usec[pktIndex];
-    module->NANOSEC[quaboIndex] = NANOSEC;
+    //printf("ACQMode = %u, LastMode = %u, Mode = %u, ModuleNum = %u, QuaboNum = %u, UTC = %u, NANOSEC = %u, PKTNUM = %u\n", acqmode, frame->lastMode, mode, moduleNum, quaboNum, UTC, NANOSEC, PKTNUM);
+    //storePktDataIntoModPair((uint8_t *)frame->data, data_ptr, mode, quaboIndex);
+    memcpy(frame->rec.data + (quaboIndex*quabo_size), in_block->data_block + (pktIndex*PKTDATASIZE), sizeof(uint8_t)*quabo_size);
+    const char* pixels = in_block->data_block + (pktIndex*PKTDATASIZE);
+    if (trigger_pixels > 0){
+        //The quabos of the pair are owned by this worker, so their baselines are too
+        int quabo = HSD_topology_quabo(topo, desc->boardloc);
+        triggerBaseline_t* b = &(trigger_baselines[(mode == 16) ? ASM_SLOT_16BIT : ASM_SLOT_8BIT][quabo]);
+
+        //Test the packet against the baseline before it is added to it
+        int fired = 0;
+        if (b->n >= TRIGGER_MIN_BASELINE){
+            int above = (mode == 16) ? triggerCount(b, (const uint16_t*)pixels)
+                                     : triggerCount(b, (const uint8_t*)pixels);
+            fired = (above >= trigger_pixels);
+            frame->trigger |= fired;
+        }
+
+        //A packet that fires is clipped so a transient does not raise the baseline
+        if (mode == 16){
+            triggerUpdate(b, (const uint16_t*)pixels, fired);
+        } else {
+            triggerUpdate(b, (const uint8_t*)pixels, fired);
+        }
+    }
+    if (pixstats){
+        //The quabos of the pair are owned by this worker, so their statistics are too
+        int quabo = HSD_topology_quabo(topo, desc->boardloc);
+        HSD_pixstats_quabo_t* q = &(pixstats->live[(mode == 16) ? PIXSTATS_MODE_16BIT : PIXSTATS_MODE_8BIT][quabo]);
+
+        if (--(q->skip) <= 0){
+            q->skip = pixstats_decimation;
+            if (mode == 16){
+                HSD_pixstats_update(q, (const uint16_t*)pixels);
+            } else {
+                HSD_pixstats_update(q, (const uint8_t*)pixels);
+            }
+        }
+    }
+    frame->rec.PKTNUM[quaboIndex] = PKTNUM;
+    //frame->UTC[quaboIndex] = UTC;
+    recvTimeToTimeval(desc->recvTime, frame->rec.tv_sec + quaboIndex, frame->rec.tv_usec + quaboIndex);
+    frame->rec.NANOSEC[quaboIndex] = NANOSEC;
 
     //Mark the status for the packet slot as taken
-    module->status = module->status | currentStatus;
+    frame->status = frame->status | currentStatus;
+
+    //Write the frame out once all quabos of the pair are in it
+    if (frame->status == PAIR_COMPLETE){
+        emitFrame(module, slot, pos, out_block);
+    }
+}
+
+/**
+ * Storing the module data to the modulePairData from the data pointer.
+ * The mode is decided for each packet, the compute workers use the kernels of assembleRun.
+ */
+void storeData(modulePairData_t* module, HSD_input_block_t* in_block, HSD_output_block_t* out_block, int pktIndex){
+    const HSD_pkt_desc_t* desc = &(in_block->header.pkt[pktIndex]);
+    char acqmode = desc->acqmode;
+
+    //Check the acqmode to determine the mode in which the packet is coming in as
+    switch (kernelOf(acqmode)){
+        case KERNEL_PH:
+            writePHToOutBuf<0>(in_block, pktIndex, out_block);
+            if (ph_window_ns){
+                addPHEvent(module, desc, out_block);
+            }
+            break;
+        case KERNEL_16BIT:
+            storeImaging<0>(module, in_block, out_block, pktIndex, 16);
+            break;
+        case KERNEL_8BIT:
+            storeImaging<0>(module, in_block, out_block, pktIndex, 8);
+            break;
+        default:
+            //Unidentified mode
+            //Return and not store the packet and return an error
+            printf("A new mode was identify acqmode=%X\n", acqmode);
+            printf("moduleNum=%X quaboNum=%X PKTNUM=%X\n", HSD_pkt_modnum(desc), HSD_pkt_quanum(desc), desc->pktNum);
+            printf("packet skipped\n");
+            break;
+    }
 }
 
 
@@ -231,24 +744,355 @@ void storeData(modulePairData_t* module, HSD_input_block_t* in_block, HSD_output
 typedef struct quabo_info{
     uint16_t prev_pkt_num[NUM_OF_MODES+1];
     int lost_pkts[NUM_OF_MODES+1];
-    quabo_info* next_quabo_info;
+    int detected;
 } quabo_info_t;
 
 /**
- * Initializing a new quabo_info object
+ * Initializing a quabo_info object
  */
-quabo_info_t* quabo_info_t_new(){
-    quabo_info_t* value = (quabo_info_t*) malloc(sizeof(struct quabo_info));
+void quabo_info_init(quabo_info_t* value){
     memset(value->lost_pkts, -1, sizeof(value->lost_pkts));
     memset(value->prev_pkt_num, 0, sizeof(value->prev_pkt_num));
-    value->next_quabo_info = NULL;
-    return value;
+    value->detected = 0;
+}
+
+/**
+ * The compute workers that assemble the module pairs. Each module pair is owned by
+ * one worker, so the workers share no assembly state. Worker 0 is the compute thread
+ * itself and the other workers are started by it and run one input block at a time.
+ */
+typedef struct compute_workers {
+    int n_workers;                      // Number of workers including the compute thread
+    pthread_t thread[COMPUTE_MAX_WORKERS];
+    pthread_barrier_t start;            // Released when a block is ready to be assembled
+    pthread_barrier_t done;             // Released when all workers finished the block
+    pthread_mutex_t lock;               // Guards released
+    pthread_cond_t ready;               // Signaled when the barriers are set up for the workers that started
+    int released;
+    HSD_input_block_t* in_block;        // The block being assembled or NULL to only flush frames
+    HSD_output_block_t* out_block;
+    uint64_t flush_before;              // Frames started before this monotonic time are written out
+    int quit;
+} compute_workers_t;
+
+//The compute workers, set up by init with COMPWRKS workers
+static compute_workers_t workers;
+
+/**
+ * Assemble a run of packets of the input block with the same kernel that belong to the module
+ * pairs owned by the worker. Packets from modules not in the config file are reported by worker 0.
+ */
+template<int KERNEL>
+static void assembleRun(int worker, HSD_input_block_t* in_block, HSD_output_block_t* out_block, int begin, int end){
+    modulePairData_t* currentModule;
+    uint16_t moduleNum;
+    for(int i = begin; i < end; i++){
+        moduleNum = HSD_pkt_modnum(&(in_block->header.pkt[i]));
+        int pair = HSD_topology_pair(topo, moduleNum);
+
+        if (pair < 0){
+            if (worker == 0){
+                printf("Detected New Module not in Config File: %u.%u\n", (unsigned int) (moduleNum << 2)/0x100, (moduleNum << 2) % 0x100);
+                printf("Packet skipping\n");
+            }
+            continue;
+        }
+        currentModule = &(modulePairs[pair]);
+        if (currentModule->worker != worker){
+            continue;
+        }
+
+        if (KERNEL == KERNEL_PH){
+            writePHToOutBuf<PKTDATASIZE>(in_block, i, out_block);
+            if (ph_window_ns){
+                addPHEvent(currentModule, &(in_block->header.pkt[i]), out_block);
+            }
+        } else if (KERNEL == KERNEL_16BIT || KERNEL == KERNEL_8BIT){
+            storeImaging<KERNEL>(currentModule, in_block, out_block, i);
+        } else {
+            storeData(currentModule, in_block, out_block, i);
+        }
+    }
+}
+
+/**
+ * Assemble the packets of the input block that belong to the module pairs owned by the worker,
+ * then write out the frames of these pairs that were started before flush_before. The frames
+ * still in flight are moved out of the output block before it is passed on.
+ * Packets from modules not in the config file are reported by worker 0.
+ */
+static void computeShard(int worker, HSD_input_block_t* in_block, HSD_output_block_t* out_block, uint64_t flush_before){
+    int n_packets = in_block ? in_block->header.data_block_size : 0;
+
+    //Split the block into runs of packets with the same kernel and assemble each run with its kernel
+    int begin = 0;
+    while (begin < n_packets){
+        int kernel = kernelOf(in_block->header.pkt[begin].acqmode);
+        int end = begin + 1;
+        while (end < n_packets && kernelOf(in_block->header.pkt[end].acqmode) == kernel){
+            end++;
+        }
+        switch (kernel){
+            case KERNEL_PH:
+                assembleRun<KERNEL_PH>(worker, in_block, out_block, begin, end);
+                break;
+            case KERNEL_16BIT:
+                assembleRun<KERNEL_16BIT>(worker, in_block, out_block, begin, end);
+                break;
+            case KERNEL_8BIT:
+                assembleRun<KERNEL_8BIT>(worker, in_block, out_block, begin, end);
+                break;
+            default:
+                assembleRun<KERNEL_NONE>(worker, in_block, out_block, begin, end);
+                break;
+        }
+        begin = end;
+    }
+
+    for (int pair = worker; pair < topo->n_pairs; pair += workers.n_workers){
+        if (flush_before != 0){
+            int n = flushPair(&(modulePairs[pair]), flush_before, out_block);
+            if (n > 0 && flush_before != UINT64_MAX){
+                __atomic_add_fetch(&asm_stale_frames, n, __ATOMIC_RELAXED);
+            }
+        }
+        detachPair(&(modulePairs[pair]), out_block);
+    }
+}
+
+/**
+ * Check if any frame in flight or PH coincidence group was started before the given time.
+ * Must not be called while the workers are assembling a block.
+ */
+static int framesInFlight(uint64_t opened_before_ns){
+    for (int pair = 0; pair < topo->n_pairs; pair++){
+        if (phGroupStale(&(modulePairs[pair]), opened_before_ns)){
+            return 1;
+        }
+        for (int s = 0; s < ASM_N_SLOTS && modulePairs[pair].n_frames > 0; s++){
+            if (slotStale(&(modulePairs[pair].slot[s]), opened_before_ns)){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Monotonic time before which frames in flight are stale, or 0 when frames never go stale.
+ */
+static uint64_t staleBefore(){
+    uint64_t now = monotonic_ns();
+    if (asm_max_age_ns == 0 || now <= asm_max_age_ns){
+        return 0;
+    }
+    return now - asm_max_age_ns;
+}
+
+/**
+ * Publish the frames and PH events written out stale or lost by the assembly.
+ * Must not be called while the workers are assembling a block.
+ */
+static void publishAsmCounters(hashpipe_status_t* st){
+    hashpipe_status_lock_safe(st);
+    hputi8(st->buf, "ASMSTALE", asm_stale_frames);
+    hputi8(st->buf, "ASMLOST", asm_lost_frames);
+    hputi8(st->buf, "PHCLOST", ph_lost_events);
+    hashpipe_status_unlock_safe(st);
+}
+
+/**
+ * Remove the records left without a frame (status 0) by the frames in flight that were moved to their
+ * local copy, so they take neither records nor stream data of the output block. The records keep their
+ * order, and their data is packed in the order of its offsets, so it is only moved down.
+ * Must not be called while the workers are assembling a block.
+ */
+static void compactOutputBlock(HSD_output_block_t* out_block){
+    HSD_output_block_header_t* out_header = &(out_block->header);
+    int n_records = out_header->stream_block_size;
+    int first = 0;
+    while (first < n_records && out_header->status[first] != 0){
+        first++;
+    }
+    if (first == n_records){
+        return;
+    }
+
+    //The workers reserve the records and their data separately, so the data may be in another order
+    int order[OUT_MODPAIR_PER_BLOCK];
+    int n_frames = 0;
+    for (int i = 0; i < n_records; i++){
+        if (out_header->status[i] == 0){
+            continue;
+        }
+        int pos = n_frames++;
+        while (pos > 0 && out_header->stream_offset[order[pos - 1]] > out_header->stream_offset[i]){
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = i;
+    }
+    uint32_t data_offset = 0;
+    for (int k = 0; k < n_frames; k++){
+        int i = order[k];
+        unsigned int data_size = HSD_modpair_data_size(out_header->acqmode[i]);
+        if (out_header->stream_offset[i] != data_offset){
+            memmove(out_block->stream_block + data_offset, HSD_output_stream_record(out_block, i), data_size);
+            out_header->stream_offset[i] = data_offset;
+        }
+        data_offset += data_size;
+    }
+    out_header->stream_data_size = data_offset;
+
+    //Move the records with a frame down over the records without one
+    int out_index = first;
+    for (int i = first + 1; i < n_records; i++){
+        if (out_header->status[i] == 0){
+            continue;
+        }
+        out_header->modNum[out_index*2] = out_header->modNum[i*2];
+        out_header->modNum[(out_index*2)+1] = out_header->modNum[(i*2)+1];
+        out_header->acqmode[out_index] = out_header->acqmode[i];
+        memcpy(out_header->pktNum + out_index*PKTPERPAIR, out_header->pktNum + i*PKTPERPAIR, sizeof(out_header->pktNum[0])*PKTPERPAIR);
+        memcpy(out_header->pktNSEC + out_index*PKTPERPAIR, out_header->pktNSEC + i*PKTPERPAIR, sizeof(out_header->pktNSEC[0])*PKTPERPAIR);
+        memcpy(out_header->tv_sec + out_index*PKTPERPAIR, out_header->tv_sec + i*PKTPERPAIR, sizeof(out_header->tv_sec[0])*PKTPERPAIR);
+        memcpy(out_header->tv_usec + out_index*PKTPERPAIR, out_header->tv_usec + i*PKTPERPAIR, sizeof(out_header->tv_usec[0])*PKTPERPAIR);
+        out_header->status[out_index] = out_header->status[i];
+        out_header->trigger[out_index] = out_header->trigger[i];
+        out_header->stream_offset[out_index] = out_header->stream_offset[i];
+        out_index++;
+    }
+    out_header->stream_block_size = out_index;
+}
+
+/**
+ * Let all workers assemble the input block into the output block and write out the frames
+ * started before flush_before, then remove the records of the frames still in flight from the block.
+ * Cancellation is held off until all workers are done. Worker 0 is the calling thread.
+ */
+static void computeBlock(HSD_input_block_t* in_block, HSD_output_block_t* out_block, uint64_t flush_before){
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    workers.in_block = in_block;
+    workers.out_block = out_block;
+    workers.flush_before = flush_before;
+    if (workers.n_workers > 1){
+        pthread_barrier_wait(&workers.start);
+    }
+    computeShard(0, in_block, out_block, flush_before);
+    if (workers.n_workers > 1){
+        pthread_barrier_wait(&workers.done);
+    }
+    compactOutputBlock(out_block);
+    pthread_setcancelstate(cancel_state, NULL);
+}
+
+/**
+ * Reset the output block before it is filled.
+ */
+static void resetOutputBlock(HSD_output_block_t* out_block, int INTSIG){
+    out_block->header.stream_block_size = 0;
+    out_block->header.stream_data_size = 0;
+    out_block->header.coinc_block_size = 0;
+    out_block->header.coinc_data_size = 0;
+    out_block->header.phe_block_size = 0;
+    out_block->header.INTSIG = INTSIG;
+}
+
+/**
+ * Wait for the output block to be free.
+ */
+/**
+ * Publish the pixel statistics when they are due or when the output thread waits for them to be
+ * closed for its file. Must not be called while the workers are assembling a block.
+ */
+static void publishPixelStats(){
+    if (pixstats && (monotonic_ns() >= pixstats_next_ns || HSD_pixstats_close_requested(pixstats))){
+        HSD_pixstats_publish(pixstats);
+        pixstats_next_ns = monotonic_ns() + pixstats_interval_ns;
+    }
+}
+
+static void waitOutputFree(HSD_output_databuf_t* db_out, int curblock_out, hashpipe_status_t* st, const char* status_key){
+    int rv;
+    while ((rv=HSD_output_databuf_wait_free(db_out, curblock_out)) != HASHPIPE_OK) {
+        if (rv==HASHPIPE_TIMEOUT) {
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "blocked compute out");
+            hashpipe_status_unlock_safe(st);
+
+            //The output thread may wait for the pixel statistics before it frees a block
+            publishPixelStats();
+            continue;
+        } else {
+            hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+            pthread_exit(NULL);
+            break;
+        }
+    }
+}
+
+/**
+ * Write the frames in flight started before flush_before to output blocks of their own,
+ * using as many blocks as needed. The last block carries INTSIG.
+ */
+static void flushToOutput(HSD_output_databuf_t* db_out, int* curblock_out, hashpipe_status_t* st,
+                          const char* status_key, uint64_t flush_before, int INTSIG){
+    do {
+        waitOutputFree(db_out, *curblock_out, st, status_key);
+        HSD_output_block_t* out_block = &(db_out->block[*curblock_out]);
+        resetOutputBlock(out_block, 0);
+        computeBlock(NULL, out_block, flush_before);
+        if (!framesInFlight(flush_before)){
+            out_block->header.INTSIG = INTSIG;
+        }
+        HSD_output_databuf_set_filled(db_out, *curblock_out);
+        *curblock_out = (*curblock_out + 1) % db_out->header.n_block;
+    } while (framesInFlight(flush_before));
 }
 
-//Initializing the linked list to be used for stroing the modulePairData
-static modulePairData_t* moduleListBegin = modulePairData_t_new();
-static modulePairData_t* moduleListEnd = moduleListBegin;
-static modulePairData_t* moduleInd[MODULEINDEXSIZE] = {NULL};
+/**
+ * Run loop of the compute workers other than worker 0.
+ */
+static void *computeWorkerRun(void *arg){
+    int worker = (int)(intptr_t)arg;
+
+    //Wait until the barriers are sized for the workers that could be started
+    pthread_mutex_lock(&workers.lock);
+    while (!workers.released){
+        pthread_cond_wait(&workers.ready, &workers.lock);
+    }
+    pthread_mutex_unlock(&workers.lock);
+
+    while (1){
+        pthread_barrier_wait(&workers.start);
+        if (workers.quit){
+            break;
+        }
+        computeShard(worker, workers.in_block, workers.out_block, workers.flush_before);
+        pthread_barrier_wait(&workers.done);
+    }
+    return NULL;
+}
+
+/**
+ * Stop and join the compute workers. Called when the compute thread exits or is cancelled,
+ * which only happens while the workers wait for the next block.
+ */
+static void computeWorkersStop(void *arg __attribute__((unused))){
+    if (workers.n_workers <= 1){
+        return;
+    }
+    workers.quit = 1;
+    pthread_barrier_wait(&workers.start);
+    for (int w = 1; w < workers.n_workers; w++){
+        pthread_join(workers.thread[w], NULL);
+    }
+    pthread_barrier_destroy(&workers.start);
+    pthread_barrier_destroy(&workers.done);
+    pthread_cond_destroy(&workers.ready);
+    pthread_mutex_destroy(&workers.lock);
+}
 
 
 
@@ -260,51 +1104,126 @@ static int init(hashpipe_thread_args_t * args){
         db_out->block[i].header.INTSIG = 0;
     }
 
-    //Initializing the Module Pairing using the config file given
-    FILE *modConfig_file = fopen(CONFIGFILE, "r");
-    char fbuf[100];
-    char cbuf;
-    unsigned int mod1Name;
-    unsigned int mod2Name;
+    //Get the number of compute workers from the status buffer
+    hashpipe_status_t st = args->st;
+    hashpipe_status_lock_safe(&st);
+    workers.n_workers = 1;
+    hgeti4(st.buf, "COMPWRKS", &(workers.n_workers));
+    if (workers.n_workers < 1 || workers.n_workers > COMPUTE_MAX_WORKERS){
+        printf("Warning: COMPWRKS=%i is out of range. Using 1 compute worker.\n", workers.n_workers);
+        workers.n_workers = 1;
+    }
+    hputi4(st.buf, "COMPWRKS", workers.n_workers);
 
-    if (modConfig_file == NULL) {
+    //Get the number of frames in flight per module pair
+    hgeti4(st.buf, "ASMWIN", &asm_window);
+    if (asm_window < 1 || asm_window > ASM_MAX_WINDOW){
+        printf("Warning: ASMWIN=%i is out of range. Using a window of 1 frame.\n", asm_window);
+        asm_window = 1;
+    }
+    hputi4(st.buf, "ASMWIN", asm_window);
+
+    //Get the age in ms after which incomplete frames are written out
+    int asm_max_age_ms = asm_max_age_ns / 1000000;
+    hgeti4(st.buf, "ASMAGE", &asm_max_age_ms);
+    if (asm_max_age_ms < 0){
+        asm_max_age_ms = 0;
+    }
+    asm_max_age_ns = (uint64_t)asm_max_age_ms * 1000000ULL;
+    hputi4(st.buf, "ASMAGE", asm_max_age_ms);
+
+    //Get the interval in ms the pixel statistics are published at, 0 to not keep them
+    int pixstats_interval_ms = pixstats_interval_ns / 1000000;
+    hgeti4(st.buf, "PIXSTINT", &pixstats_interval_ms);
+    if (pixstats_interval_ms < 0){
+        pixstats_interval_ms = 0;
+    }
+    pixstats_interval_ns = (uint64_t)pixstats_interval_ms * 1000000ULL;
+    hputi4(st.buf, "PIXSTINT", pixstats_interval_ms);
+
+    //Get the decimation of the packets added to the pixel statistics
+    hgeti4(st.buf, "PIXSTDEC", &pixstats_decimation);
+    if (pixstats_decimation < 1){
+        printf("Warning: PIXSTDEC=%i is out of range. Using every packet.\n", pixstats_decimation);
+        pixstats_decimation = 1;
+    }
+    hputi4(st.buf, "PIXSTDEC", pixstats_decimation);
+
+    //Get the transient trigger
+    double trigger_sigma = 5.0;
+    hgeti4(st.buf, "TRIGPIX", &trigger_pixels);
+    hgetr8(st.buf, "TRIGSIG", &trigger_sigma);
+    if (trigger_pixels > SCIDATASIZE){
+        printf("Warning: TRIGPIX=%i is more than the pixels of a quabo. Using %i.\n", trigger_pixels, SCIDATASIZE);
+        trigger_pixels = SCIDATASIZE;
+    }
+    trigger_k2 = trigger_sigma * trigger_sigma;
+    hputi4(st.buf, "TRIGPIX", trigger_pixels);
+    hputr8(st.buf, "TRIGSIG", trigger_sigma);
+
+    //Window in ns and min number of packets of the PH coincidence events
+    int ph_window = 0;
+    hgeti4(st.buf, "PHCWIN", &ph_window);
+    hgeti4(st.buf, "PHCMIN", &ph_min_multiplicity);
+    if (ph_window < 0){
+        printf("Warning: PHCWIN=%i is negative. PH coincidence events are not grouped.\n", ph_window);
+        ph_window = 0;
+    }
+    if (ph_min_multiplicity < 1 || ph_min_multiplicity > PKTPERPAIR){
+        printf("Warning: PHCMIN=%i is out of range. Using 2 packets.\n", ph_min_multiplicity);
+        ph_min_multiplicity = 2;
+    }
+    ph_window_ns = ph_window;
+    hputi4(st.buf, "PHCWIN", ph_window);
+    hputi4(st.buf, "PHCMIN", ph_min_multiplicity);
+    hashpipe_status_unlock_safe(&st);
+
+    //Initializing the Module Pairing using the config file given
+    topo = HSD_topology_get();
+    if (topo == NULL) {
         perror("Error Opening Config File\n");
         exit(1);
     }
-    cbuf = getc(modConfig_file);
-    char moduleName[50];
+    int n_pairs = topo->n_pairs;
+    modulePairs = (modulePairData_t*) malloc(sizeof(modulePairData_t) * (n_pairs > 0 ? n_pairs : 1));
+    if (modulePairs == NULL){
+        printf("Error: Unable to malloc space for ModulePairData\n");
+        exit(1);
+    }
 
-    while(cbuf != EOF){
-        ungetc(cbuf, modConfig_file);
-        if (cbuf != '#'){
-            if (fscanf(modConfig_file, "%u %u\n", &mod1Name, &mod2Name) == 2){
-                if (moduleInd[mod1Name] == NULL && moduleInd[mod2Name] == NULL){
+    for (int pair = 0; pair < n_pairs; pair++){
+        unsigned int mod1Name = topo->module_num[pair*2];
+        unsigned int mod2Name = topo->module_num[pair*2 + 1];
+        modulePairData_init(&(modulePairs[pair]), mod1Name, mod2Name);
 
-                    sprintf(moduleName, MODULEPAIR_FORMAT, mod1Name, mod2Name);
+        //Spread the module pairs over the compute workers
+        modulePairs[pair].worker = pair % workers.n_workers;
 
-                    moduleInd[mod1Name] = moduleInd[mod2Name] = moduleListEnd->next_moduleID 
-                                            = modulePairData_t_new(mod1Name, mod2Name);
-                    
-                    moduleListEnd = moduleListEnd->next_moduleID;
-                    
-                    //createQuaboTables(moduleListEnd->dynamicMeta, moduleListEnd);
+        printf("Created Module Pair: %u.%u-%u and %u.%u-%u\n", 
+        (unsigned int) (mod1Name << 2)/0x100, (mod1Name << 2) % 0x100, ((mod1Name << 2) % 0x100) + 3,
+        (mod2Name << 2)/0x100, (mod2Name << 2) % 0x100, ((mod2Name << 2) % 0x100) + 3);
+    }
 
-                    printf("Created Module Pair: %u.%u-%u and %u.%u-%u\n", 
-                    (unsigned int) (mod1Name << 2)/0x100, (mod1Name << 2) % 0x100, ((mod1Name << 2) % 0x100) + 3,
-                    (mod2Name << 2)/0x100, (mod2Name << 2) % 0x100, ((mod2Name << 2) % 0x100) + 3);
-                }
-            }
-        } else {
-            if (fgets(fbuf, 100, modConfig_file) == NULL){
-                break;
-            }
+    if (pixstats_interval_ns > 0){
+        pixstats = HSD_pixstats_create(topo->n_modules * QUABOPERMODULE);
+        if (pixstats == NULL){
+            printf("Warning: Unable to malloc space for the pixel statistics. They are not kept.\n");
         }
-        cbuf = getc(modConfig_file);
     }
 
-    if (fclose(modConfig_file) == EOF){
-        printf("Warning: Unable to close module configuration file.\n");
+    if (trigger_pixels > 0){
+        int n_quabos = topo->n_modules * QUABOPERMODULE;
+        for (int s = 0; s < ASM_N_SLOTS; s++){
+            trigger_baselines[s] = (triggerBaseline_t*) aligned_alloc(CACHE_ALIGNMENT, sizeof(triggerBaseline_t) * (n_quabos > 0 ? n_quabos : 1));
+            if (trigger_baselines[s] == NULL){
+                printf("Error: Unable to malloc space for the trigger baselines\n");
+                exit(1);
+            }
+            memset(trigger_baselines[s], 0, sizeof(triggerBaseline_t) * (n_quabos > 0 ? n_quabos : 1));
+        }
     }
+
+    printf("Assembling %i module pairs with %i compute workers\n", n_pairs, workers.n_workers);
     printf("-----------Finished Setup of Compute Thread-----------\n\n");
     
     return 0;
@@ -332,11 +1251,13 @@ static void *run(hashpipe_thread_args_t * args){
 
     //Variables to display pkt info
     uint8_t mode;                                       //The current mode of the packet block
-    quabo_info_t* quaboListBegin = quabo_info_t_new();  //Initializing the quabo info linked list
-    quabo_info_t* quaboListEnd = quaboListBegin;        //Setting the pointer to be the end of the linked list
-    quabo_info_t* quaboInd[0xffff] = {NULL};            //Create a rudimentary hash map of the quabo number and linked list ind
+    int n_quabos = topo->n_modules * QUABOPERMODULE;
+    quabo_info_t* quabos = (quabo_info_t*) malloc(sizeof(quabo_info_t) * (n_quabos > 0 ? n_quabos : 1));  //Quabo info indexed by quabo index
+    for (int q = 0; q < n_quabos; q++){
+        quabo_info_init(&(quabos[q]));
+    }
 
-    quabo_info_t* currentQuabo;                         //Pointer to the quabo info that is currently being used
+    quabo_info_t* currentQuabo = NULL;                  //Pointer to the quabo info that is currently being used
     uint16_t boardLoc;                                  //The boardLoc(quabo index) for the current packet
     char* boardLocstr = (char *)malloc(sizeof(char)*10);
 
@@ -352,6 +1273,40 @@ static void *run(hashpipe_thread_args_t * args){
     int total_lost_pkts = 0;
     int current_pkt_lost;
 
+    //Start the compute workers other than this thread. If a worker can not be started the
+    //module pairs are spread over the workers that did start.
+    if (workers.n_workers > 1){
+        pthread_mutex_init(&workers.lock, NULL);
+        pthread_cond_init(&workers.ready, NULL);
+        workers.released = 0;
+        int started = 1;
+        while (started < workers.n_workers &&
+               pthread_create(&(workers.thread[started]), NULL, computeWorkerRun, (void *)(intptr_t)started) == 0){
+            started++;
+        }
+        if (started < workers.n_workers){
+            printf("Warning: Unable to start compute worker %i. Using %i compute workers.\n", started, started);
+            workers.n_workers = started;
+            for (int pair = 0; pair < topo->n_pairs; pair++){
+                modulePairs[pair].worker = pair % workers.n_workers;
+            }
+            hashpipe_status_lock_safe(&st);
+            hputi4(st.buf, "COMPWRKS", workers.n_workers);
+            hashpipe_status_unlock_safe(&st);
+        }
+        if (workers.n_workers > 1){
+            pthread_barrier_init(&workers.start, NULL, workers.n_workers);
+            pthread_barrier_init(&workers.done, NULL, workers.n_workers);
+            pthread_mutex_lock(&workers.lock);
+            workers.released = 1;
+            pthread_cond_broadcast(&workers.ready);
+            pthread_mutex_unlock(&workers.lock);
+        } else {
+            pthread_cond_destroy(&workers.ready);
+            pthread_mutex_destroy(&workers.lock);
+        }
+    }
+    pthread_cleanup_push(computeWorkersStop, NULL);
     
     while(run_threads()){
         hashpipe_status_lock_safe(&st);
@@ -367,6 +1322,14 @@ static void *run(hashpipe_thread_args_t * args){
                 hashpipe_status_lock_safe(&st);
                 hputs(st.buf, status_key, "blocked");
                 hashpipe_status_unlock_safe(&st);
+
+                //Write out the frames that go stale while no packets arrive
+                uint64_t flush_before = staleBefore();
+                if (flush_before && framesInFlight(flush_before)){
+                    flushToOutput(db_out, &curblock_out, &st, status_key, flush_before, 0);
+                    publishAsmCounters(&st);
+                }
+                publishPixelStats();
                 continue;
             } else {
                 hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
@@ -376,86 +1339,67 @@ static void *run(hashpipe_thread_args_t * args){
         }
 
         // Wait for new output block to be free
-        while ((rv=HSD_output_databuf_wait_free(db_out, curblock_out)) != HASHPIPE_OK) {
-            if (rv==HASHPIPE_TIMEOUT) {
-                hashpipe_status_lock_safe(&st);
-                hputs(st.buf, status_key, "blocked compute out");
-                hashpipe_status_unlock_safe(&st);
-                continue;
-            } else {
-                hashpipe_error(__FUNCTION__, "error waiting for free databuf");
-                pthread_exit(NULL);
-                break;
-            }
-        }
+        waitOutputFree(db_out, curblock_out, &st, status_key);
 
         //Note processing status
         hashpipe_status_lock_safe(&st);
         hputs(st.buf, status_key, "processing packet");
         hashpipe_status_unlock_safe(&st);
 
-        db_out->block[curblock_out].header.stream_block_size = 0;
-        db_out->block[curblock_out].header.coinc_block_size = 0;
-        db_out->block[curblock_out].header.INTSIG = db_in->block[curblock_in].header.INTSIG;
         INTSIG = db_in->block[curblock_in].header.INTSIG;
+        resetOutputBlock(&(db_out->block[curblock_out]), INTSIG);
 
-        modulePairData_t* currentModule;
-        uint16_t moduleNum;
         #ifdef TEST_MODE
             printf("Size of intput buffer data block: %i\n", db_in->block[curblock_in].header.data_block_size);
         #endif
-        for(int i = 0; i < db_in->block[curblock_in].header.data_block_size; i++){
-            //----------------CALCULATION BLOCK-----------------
-            moduleNum = db_in->block[curblock_in].header.modNum[i];
+        //----------------CALCULATION BLOCK-----------------
+        //Each worker assembles its own module pairs and writes out their stale frames.
+        //All frames in flight are drained on INTSIG.
+        uint64_t flush_before = INTSIG ? UINT64_MAX : staleBefore();
+        computeBlock(&(db_in->block[curblock_in]), &(db_out->block[curblock_out]), flush_before);
+        publishAsmCounters(&st);
 
-            if (moduleInd[moduleNum] == NULL){
+        //Publish the pixel statistics while the workers are idle
+        publishPixelStats();
+        //------------End CALCULATION BLOCK----------------
 
-                printf("Detected New Module not in Config File: %u.%u\n", (unsigned int) (moduleNum << 2)/0x100, (moduleNum << 2) % 0x100);
-                printf("Packet skipping\n");
+        for(int i = 0; i < db_in->block[curblock_in].header.data_block_size; i++){
+            const HSD_pkt_desc_t* desc = &(db_in->block[curblock_in].header.pkt[i]);
+            int quabo = HSD_topology_quabo(topo, desc->boardloc);
+            if (quabo < 0){
                 continue;
-
-            } else {
-                currentModule = moduleInd[moduleNum];
             }
 
-            storeData(currentModule, &(db_in->block[curblock_in]), &(db_out->block[curblock_out]), i);
-            
-            //------------End CALCULATION BLOCK----------------
-
 
             //Finding the packet number and computing the lost of packets by using packet number
             //Read the packet number from the packet
-            mode = db_in->block[curblock_in].header.acqmode[i];
-            boardLoc = db_in->block[curblock_in].header.modNum[i] * 4 + db_in->block[curblock_in].header.quaNum[i];
+            mode = desc->acqmode;
+            boardLoc = desc->boardloc;
 
-            //Check to see if there is a quabo info for the current quabo packet. If not create an object
-            if (quaboInd[boardLoc] == NULL){
-                quaboInd[boardLoc] = quabo_info_t_new();            //Create a new quabo info object
+            //Set the current Quabo to the one stored in memory
+            currentQuabo = &(quabos[quabo]);
 
+            //Check to see if this is the first packet of the quabo
+            if (!currentQuabo->detected){
+                currentQuabo->detected = 1;
                 printf("New Quabo Detected ID:%u.%u\n", (boardLoc >> 8) & 0x00ff, boardLoc & 0x00ff); //Output the terminal the new quabo
-
-                quaboListEnd->next_quabo_info = quaboInd[boardLoc];
-                quaboListEnd = quaboListEnd->next_quabo_info;       //Append the new quabo info to the end of the linked list
             }
 
-            //Set the current Quabo to the one stored in memory
-            currentQuabo = quaboInd[boardLoc];
-
             //Check to see if it is newly created quabo info if so then inialize the lost packet number to 0
             if (currentQuabo->lost_pkts[mode] < 0) {
                 currentQuabo->lost_pkts[mode] = 0;
             } else {
                 //Check to see if the current packet number is less than the previous. If so the number has overflowed and looped.
                 //Compenstate for this if this has happend, and then take the difference of the packet numbers minus 1 to be the packets lost
-                if (db_in->block[curblock_in].header.pktNum[i] < currentQuabo->prev_pkt_num[mode])
-                    current_pkt_lost = (0xffff - currentQuabo->prev_pkt_num[mode]) + db_in->block[curblock_in].header.pktNum[i];
+                if (desc->pktNum < currentQuabo->prev_pkt_num[mode])
+                    current_pkt_lost = (0xffff - currentQuabo->prev_pkt_num[mode]) + desc->pktNum;
                 else
-                    current_pkt_lost = (db_in->block[curblock_in].header.pktNum[i] - currentQuabo->prev_pkt_num[mode]) - 1;
+                    current_pkt_lost = (desc->pktNum - currentQuabo->prev_pkt_num[mode]) - 1;
                 
                 currentQuabo->lost_pkts[mode] += current_pkt_lost; //Add this packet lost to the total for this quabo
                 total_lost_pkts += current_pkt_lost;               //Add this packet lost to the overall total for all quabos
             }
-            currentQuabo->prev_pkt_num[mode] = db_in->block[curblock_in].header.pktNum[i]; //Update the previous packet number to be the current packet number
+            currentQuabo->prev_pkt_num[mode] = desc->pktNum; //Update the previous packet number to be the current packet number
 
             /*
             //Copy to output buffer
@@ -495,8 +1439,16 @@ static void *run(hashpipe_thread_args_t * args){
 
         /*Update input and output block for both buffers*/
         //Mark output block as full and advance
+        int drain_left = INTSIG && framesInFlight(UINT64_MAX);
+        if (drain_left){
+            //The drained frames continue in the next output blocks, the last one carries INTSIG
+            db_out->block[curblock_out].header.INTSIG = 0;
+        }
         HSD_output_databuf_set_filled(db_out, curblock_out);
         curblock_out = (curblock_out + 1) % db_out->header.n_block;
+        if (drain_left){
+            flushToOutput(db_out, &curblock_out, &st, status_key, UINT64_MAX, INTSIG);
+        }
 
         //Mark input block as free and advance
         HSD_input_databuf_set_free(db_in, curblock_in);
@@ -534,6 +1486,13 @@ static void *run(hashpipe_thread_args_t * args){
         pthread_testcancel();
     }
 
+    pthread_cleanup_pop(1); /* Closes push(computeWorkersStop) */
+
+    //Let the output thread store the last statistics without waiting for another publish
+    if (pixstats){
+        HSD_pixstats_finish(pixstats);
+    }
+
     printf("Returned Compute_thread\n");
     return THREAD_OK;
 }
@@ -12,22 +12,256 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <linux/mempolicy.h>
 #include "HSD_databuf.h"
 
+#define DATABUF_HUGEPAGE_SIZE   (2*1024*1024)   //Size of the hugepages backing the databufs
+#define DATABUF_MAX_NODES       1024            //Max number of NUMA nodes in a node mask
+
+/**
+ * Read an integer from the status buffer of the instance before any thread
+ * has started, and store the value used back into the status buffer.
+ * @param instance_id The hashpipe instance
+ * @param key The status key
+ * @param value The default value, which is replaced by the value of the key
+ * @param min The smallest accepted value
+ * @param max The largest accepted value
+ */
+static void databuf_status_geti4(int instance_id, const char *key, int *value, int min, int max){
+    hashpipe_status_t st;
+    int def = *value;
+    if (hashpipe_status_attach(instance_id, &st) != HASHPIPE_OK){
+        return;
+    }
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, key, value);
+    if (*value < min || *value > max){
+        printf("Warning: %s %i must be between %i and %i. Using %i.\n", key, *value, min, max, def);
+        *value = def;
+    }
+    hputi4(st.buf, key, *value);
+    hashpipe_status_unlock_safe(&st);
+    hashpipe_status_detach(&st);
+}
+
+/**
+ * Read a string from the status buffer of the instance before any thread has started.
+ * @return 1 if the key is present and 0 otherwise
+ */
+static int databuf_status_gets(int instance_id, const char *key, int len, char *value){
+    hashpipe_status_t st;
+    int found;
+    if (hashpipe_status_attach(instance_id, &st) != HASHPIPE_OK){
+        return 0;
+    }
+    hashpipe_status_lock_safe(&st);
+    found = hgets(st.buf, key, len, value);
+    hashpipe_status_unlock_safe(&st);
+    hashpipe_status_detach(&st);
+    return found;
+}
+
+/**
+ * Store a string in the status buffer of the instance.
+ */
+static void databuf_status_puts(int instance_id, const char *key, const char *value){
+    hashpipe_status_t st;
+    if (hashpipe_status_attach(instance_id, &st) != HASHPIPE_OK){
+        return;
+    }
+    hashpipe_status_lock_safe(&st);
+    hputs(st.buf, key, value);
+    hashpipe_status_unlock_safe(&st);
+    hashpipe_status_detach(&st);
+}
+
+/**
+ * Resolve the DBNUMA setting to a NUMA node. NIC is the node of the BINDHOST
+ * interface and anything else is a node number.
+ * @return The node or -1 for no binding
+ */
+static int databuf_numa_node(int instance_id){
+    char numa[80];
+    char bindhost[80];
+    char path[256];
+    int node = -1;
+
+    if (!databuf_status_gets(instance_id, "DBNUMA", sizeof(numa), numa)){
+        return -1;
+    }
+    if (strcmp(numa, "NIC")){
+        char *end;
+        long value = strtol(numa, &end, 10);
+        if (end == numa || *end != '\0' || value < -1 || value >= DATABUF_MAX_NODES){
+            printf("Warning: DBNUMA %s is not a NUMA node or NIC. The databufs are not bound.\n", numa);
+            return -1;
+        }
+        return (int)value;
+    }
+    if (!databuf_status_gets(instance_id, "BINDHOST", sizeof(bindhost), bindhost)){
+        printf("Warning: DBNUMA NIC needs BINDHOST to be set.\n");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", bindhost);
+    FILE *fp = fopen(path, "r");
+    if (!fp || fscanf(fp, "%i", &node) != 1){
+        printf("Warning: Unable to read the NUMA node of %s.\n", bindhost);
+        node = -1;
+    }
+    if (fp) fclose(fp);
+    return node;
+}
+
+/**
+ * Report where the pages of the databuf ended up by sampling the NUMA node of
+ * pages across the databuf, and publish it as DBPLACE<databuf_id>.
+ */
+static void databuf_report_placement(int instance_id, int databuf_id, hashpipe_databuf_t *d,
+                                     size_t size, int huge, int locked){
+    char key[16];
+    char placement[80];
+    int first_node = -1;
+    int mixed = 0;
+    size_t page = huge ? DATABUF_HUGEPAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+
+    //Sample up to 64 pages spread over the databuf
+    size_t npages = (size + page - 1) / page;
+    size_t stride = (npages > 64) ? npages / 64 : 1;
+    for (size_t i = 0; i < npages; i += stride){
+        int node = -1;
+        if (syscall(__NR_get_mempolicy, &node, NULL, 0, (char *)d + i * page, MPOL_F_NODE | MPOL_F_ADDR) != 0){
+            break;
+        }
+        if (first_node < 0) first_node = node;
+        else if (node != first_node) mixed = 1;
+    }
+
+    if (mixed){
+        snprintf(placement, sizeof(placement), "huge=%i locked=%i node=mixed", huge, locked);
+    } else {
+        snprintf(placement, sizeof(placement), "huge=%i locked=%i node=%i", huge, locked, first_node);
+    }
+    printf("Databuf %i: %zu bytes %s\n", databuf_id, size, placement);
+    snprintf(key, sizeof(key), "DBPLACE%i", databuf_id);
+    databuf_status_puts(instance_id, key, placement);
+}
+
+/**
+ * Create a databuf with hashpipe, optionally backed by hugepages, bound to a
+ * NUMA node and locked in memory. The options are read from the DBHUGE,
+ * DBNUMA and DBMLOCK status keys.
+ *
+ * Hashpipe creates the segment with shmget(IPC_CREAT), attaches it, zeroes it
+ * and sets up its semaphores. When hugepages are requested the segment is
+ * created here first with the same key so that hashpipe reuses it. When a NUMA
+ * node is requested the memory policy of the thread is bound to it while the
+ * pages are faulted in.
+ */
+static hashpipe_databuf_t *HSD_databuf_create(int instance_id, int databuf_id, size_t header_size,
+                                              size_t block_size, int n_block){
+    size_t size = header_size + block_size * n_block;
+    int huge = 0;
+    int numa;
+    int mlocked = 0;
+    int shmid = -1;
+    int dbmlock = 0;
+    int dbhuge = 0;
+
+    databuf_status_geti4(instance_id, "DBHUGE", &dbhuge, 0, 1);
+    databuf_status_geti4(instance_id, "DBMLOCK", &dbmlock, 0, 1);
+    numa = databuf_numa_node(instance_id);
+
+    if (dbhuge){
+        key_t key = hashpipe_databuf_key(instance_id) + databuf_id - 1;
+        size_t huge_size = (size + DATABUF_HUGEPAGE_SIZE - 1) / DATABUF_HUGEPAGE_SIZE * DATABUF_HUGEPAGE_SIZE;
+        shmid = shmget(key, huge_size, 0666 | IPC_CREAT | IPC_EXCL | SHM_HUGETLB);
+        if (shmid != -1){
+            huge = 1;
+        } else if (errno == EEXIST){
+            printf("Warning: Databuf %i already exists and is reused without hugepages. Remove it with ipcrm to use hugepages.\n", databuf_id);
+        } else {
+            printf("Warning: Unable to allocate hugepages for databuf %i (%s). Check vm.nr_hugepages.\n", databuf_id, strerror(errno));
+        }
+    }
+
+    //A policy set with mbind on a temporary attach is not kept by hugetlb segments,
+    //so the pages are placed by the policy of the thread that faults them in.
+    //Bind it to the node until every page of the databuf is in.
+    int bound = 0;
+    if (numa >= 0){
+        unsigned long nodemask[DATABUF_MAX_NODES / (8 * sizeof(unsigned long))];
+        memset(nodemask, 0, sizeof(nodemask));
+        nodemask[numa / (8 * sizeof(unsigned long))] |= 1UL << (numa % (8 * sizeof(unsigned long)));
+        if (syscall(__NR_set_mempolicy, MPOL_BIND, nodemask, DATABUF_MAX_NODES) == 0){
+            bound = 1;
+        } else {
+            printf("Warning: Unable to bind databuf %i to NUMA node %i (%s).\n", databuf_id, numa, strerror(errno));
+        }
+    }
+
+    hashpipe_databuf_t *d = hashpipe_databuf_create(instance_id, databuf_id, header_size, block_size, n_block);
+    if (d && bound){
+        //Read every page so none is left to be faulted in later by another thread
+        long page_size = sysconf(_SC_PAGESIZE);
+        for (size_t off = 0; off < size; off += page_size){
+            (void)*(volatile char *)((char *)d + off);
+        }
+    }
+    if (bound){
+        syscall(__NR_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    }
+    if (!d){
+        return NULL;
+    }
+    if (shmid != -1 && d->shmid != shmid){
+        huge = 0;
+    }
+
+    //Fault every page in now and keep it resident
+    if (dbmlock){
+        if (mlock(d, size) == 0){
+            mlocked = 1;
+        } else {
+            printf("Warning: Unable to mlock databuf %i (%s). Check ulimit -l.\n", databuf_id, strerror(errno));
+        }
+    }
+
+    databuf_report_placement(instance_id, databuf_id, d, size, huge, mlocked);
+    return d;
+}
+
 hashpipe_databuf_t *HSD_input_databuf_create(int instance_id, int databuf_id){
     /* Calc databuf size */
     size_t header_size = sizeof(hashpipe_databuf_t) + sizeof(HSD_input_header_cache_alignment);
     size_t block_size = sizeof(HSD_input_block_t);
     int n_block = N_INPUT_BLOCKS;
-    return hashpipe_databuf_create(instance_id, databuf_id, header_size, block_size, n_block);
+    databuf_status_geti4(instance_id, "NINBLKS", &n_block, 2, INT16_MAX);
+    return HSD_databuf_create(instance_id, databuf_id, header_size, block_size, n_block);
 }
 
 hashpipe_databuf_t *HSD_output_databuf_create(int instance_id, int databuf_id){
     /* Calc databuf sizes */
     size_t header_size = sizeof(hashpipe_databuf_t) + sizeof(HSD_output_header_cache_alignment);
     size_t block_size = sizeof(HSD_output_block_t);
-    int n_block = N_INPUT_BLOCKS;
-    return hashpipe_databuf_create(instance_id, databuf_id, header_size, block_size, n_block);
+    int n_block = N_OUTPUT_BLOCKS;
+    databuf_status_geti4(instance_id, "NOUTBLKS", &n_block, 2, INT16_MAX);
+    return HSD_databuf_create(instance_id, databuf_id, header_size, block_size, n_block);
+}
+
+int HSD_input_pkts_per_block(hashpipe_status_t *st){
+    int pkts = IN_PKT_PER_BLOCK;
+    hashpipe_status_lock_safe(st);
+    hgeti4(st->buf, "INPKTBLK", &pkts);
+    if (pkts < 1 || pkts > IN_PKT_PER_BLOCK){
+        printf("Warning: INPKTBLK %i must be between 1 and %i. Using %i.\n", pkts, IN_PKT_PER_BLOCK, IN_PKT_PER_BLOCK);
+        pkts = IN_PKT_PER_BLOCK;
+    }
+    hputi4(st->buf, "INPKTBLK", pkts);
+    hashpipe_status_unlock_safe(st);
+    return pkts;
 }
\ No newline at end of file
@@ -1,5 +1,9 @@
+#ifndef _HSD_DATABUF_H
+#define _HSD_DATABUF_H
+
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "hashpipe.h"
 #include "hashpipe_databuf.h"
 #include "hdf5.h"
@@ -13,11 +17,12 @@
 
 //Defining the characteristics of the circuluar buffers
 #define CACHE_ALIGNMENT         256
-#define N_INPUT_BLOCKS          4                       //Number of blocks in the input buffer
-#define N_OUTPUT_BLOCKS         8                       //Number of blocks in the output buffer
-#define IN_PKT_PER_BLOCK        320                      //Number of Pkt stored in each block
+#define N_INPUT_BLOCKS          4                       //Default number of blocks in the input buffer (NINBLKS)
+#define N_OUTPUT_BLOCKS         8                       //Default number of blocks in the output buffer (NOUTBLKS)
+#define IN_PKT_PER_BLOCK        320                      //Max Number of Pkt stored in each block (INPKTBLK)
 #define OUT_MODPAIR_PER_BLOCK   320                      //Max Number of Module Pairs stored in each block
 #define COINC_PKT_PER_BLOCK     320                      //Max Number of Coinc packets stored in each block
+#define PH_EVENT_PER_BLOCK      COINC_PKT_PER_BLOCK      //Max Number of PH coincidence events stored in each block
 
 //Defining Imaging Data Values
 #define QUABOPERMODULE          4
@@ -42,7 +47,6 @@
 #define HKFIELDS                27
 #define GPSFIELDS               10
 #define NANOSECTHRESHOLD        20
-#define MODULEINDEXSIZE         0xffff
 
 #define MODULEPAIR_FORMAT "ModulePair_%05u_%05u"
 #define CONFIGFILE "./modulePair.config"
@@ -55,16 +59,23 @@
 
 
 /* INPUT BUFFER STRUCTURES */
+/**
+ * Descriptor of a packet in the input block. The header fields of a packet are
+ * packed together so the descriptors are written and read as one stream.
+ */
+typedef struct HSD_pkt_desc {
+    uint64_t recvTime;                          // Receive time of the packet in ns since the epoch
+    uint32_t pktUTC;
+    uint32_t pktNSEC;
+    uint16_t pktNum;
+    uint16_t boardloc;                          // Module number << 2 | quabo number
+    uint8_t acqmode;
+    uint8_t pad[3];
+} HSD_pkt_desc_t;
+
 typedef struct HSD_input_block_header {
     uint64_t mcnt;                              // mcount of first packet
-    char acqmode[IN_PKT_PER_BLOCK];
-    uint16_t pktNum[IN_PKT_PER_BLOCK];
-    uint16_t modNum[IN_PKT_PER_BLOCK];
-    uint8_t quaNum[IN_PKT_PER_BLOCK];
-    uint32_t pktUTC[IN_PKT_PER_BLOCK];
-    uint32_t pktNSEC[IN_PKT_PER_BLOCK];
-    long int tv_sec[IN_PKT_PER_BLOCK];
-    long int tv_usec[IN_PKT_PER_BLOCK];
+    HSD_pkt_desc_t pkt[IN_PKT_PER_BLOCK];
     int data_block_size;
     int INTSIG;
 } HSD_input_block_header_t;
@@ -82,7 +93,7 @@ typedef struct HSD_input_block {
 typedef struct HSD_input_databuf {
     hashpipe_databuf_t header;
     HSD_input_header_cache_alignment padding;   // Maintain chache alignment
-    HSD_input_block_t block[N_INPUT_BLOCKS];
+    HSD_input_block_t block[];                  // header.n_block blocks sized at create time
 } HSD_input_databuf_t;
 
 /*
@@ -99,6 +110,9 @@ typedef struct HSD_output_block_header {
     long int tv_sec[OUT_MODPAIR_PER_BLOCK*PKTPERPAIR];
     long int tv_usec[OUT_MODPAIR_PER_BLOCK*PKTPERPAIR];
     uint8_t status[OUT_MODPAIR_PER_BLOCK];
+    uint8_t trigger[OUT_MODPAIR_PER_BLOCK];         // Nonzero for frames that fired the transient trigger
+    uint32_t stream_offset[OUT_MODPAIR_PER_BLOCK];  // Offset of each module pair frame in the stream block
+    uint32_t stream_data_size;                      // Bytes of the stream block used by the frames
     int stream_block_size;
 
     
@@ -110,8 +124,19 @@ typedef struct HSD_output_block_header {
     uint32_t coin_pktNSEC[COINC_PKT_PER_BLOCK];
     long int coin_tv_sec[COINC_PKT_PER_BLOCK];
     long int coin_tv_usec[COINC_PKT_PER_BLOCK];
+    uint32_t coin_offset[COINC_PKT_PER_BLOCK];      // Offset of each PH packet in the coinc block
+    uint32_t coinc_data_size;                       // Bytes of the coinc block used by the PH packets
     int coinc_block_size;
 
+    //PH coincidence events of the module pairs, see PHCWIN of the compute thread
+    uint16_t phe_modNum[PH_EVENT_PER_BLOCK*2];
+    uint8_t phe_multiplicity[PH_EVENT_PER_BLOCK];   // Number of PH packets in the event
+    uint8_t phe_quabos[PH_EVENT_PER_BLOCK];         // Quabos of the pair in the event, one bit per quabo like the frame status
+    uint32_t phe_pktUTC[PH_EVENT_PER_BLOCK];        // Time of the earliest PH packet of the event
+    uint32_t phe_pktNSEC[PH_EVENT_PER_BLOCK];
+    uint32_t phe_span[PH_EVENT_PER_BLOCK];          // ns from the earliest to the latest PH packet of the event
+    uint16_t phe_pktNum[PH_EVENT_PER_BLOCK*PKTPERPAIR]; // pktNum of the PH packet of each quabo in the event
+    int phe_block_size;
 
     int INTSIG;
 } HSD_output_block_header_t;
@@ -120,6 +145,12 @@ typedef uint8_t HSD_output_header_cache_alignment[
     CACHE_ALIGNMENT - (sizeof(HSD_output_block_header_t)%CACHE_ALIGNMENT)
 ];
 
+/*
+ * The frames in the stream block and the PH packets in the coinc block are
+ * packed one after another at their real size, so 8 bit frames take half of
+ * a 16 bit frame. The offset tables in the header locate each record.
+ * Module pair records with status 0 hold no frame and are skipped.
+ */
 typedef struct HSD_output_block {
     HSD_output_block_header_t header;
     HSD_output_header_cache_alignment padding;  //Maintain cache alignment
@@ -130,7 +161,7 @@ typedef struct HSD_output_block {
 typedef struct HSD_output_databuf {
     hashpipe_databuf_t header;
     HSD_output_header_cache_alignment padding;
-    HSD_output_block_t block[N_OUTPUT_BLOCKS];
+    HSD_output_block_t block[];                 // header.n_block blocks sized at create time
 } HSD_output_databuf_t;
 
 /*
@@ -138,6 +169,13 @@ typedef struct HSD_output_databuf {
  */
 hashpipe_databuf_t * HSD_input_databuf_create(int instance_id, int databuf_id);
 
+/**
+ * Number of packets the producer puts in each input block, read from the
+ * INPKTBLK status key and capped by the IN_PKT_PER_BLOCK capacity.
+ * The status buffer must not be locked by the caller.
+ */
+int HSD_input_pkts_per_block(hashpipe_status_t *st);
+
 //Input databuf attach
 static inline HSD_input_databuf_t *HSD_input_databuf_attach(int instance_id, int databuf_id){
     return (HSD_input_databuf_t *)hashpipe_databuf_attach(instance_id, databuf_id);
@@ -193,12 +231,105 @@ static inline int HSD_input_databuf_set_filled(HSD_input_databuf_t *d, int block
     return hashpipe_databuf_set_filled((hashpipe_databuf_t *)d, block_id);
 }
 
+/**
+ * Size of the UDP payload of a quabo packet of the acqmode.
+ */
+static inline unsigned int HSD_packet_size(unsigned char acqmode){
+    return HEADERSIZE + ((acqmode < 4) ? PKTDATASIZE : BIT8PKTDATASIZE);
+}
+
+/**
+ * Module number of the packet from its board location.
+ */
+static inline uint16_t HSD_pkt_modnum(const HSD_pkt_desc_t* desc){
+    return desc->boardloc >> 2;
+}
+
+/**
+ * Quabo number of the packet within its module from its board location.
+ */
+static inline uint8_t HSD_pkt_quanum(const HSD_pkt_desc_t* desc){
+    return desc->boardloc & 0x03;
+}
+
+/**
+ * Get the header info of the first packet in the PKTSOCK buffer
+ * @param p_frame The pointer for the packet frame(returned from PKT_UDP_DATA(p_frame))
+ * @param desc The packet descriptor to be written to
+ */
+static inline void get_header(const unsigned char* pkt_data, HSD_pkt_desc_t* desc) {
+    desc->acqmode = pkt_data[0];
+    desc->pktNum = ((pkt_data[3] << 8) & 0xff00) 
+                        | (pkt_data[2] & 0x00ff);
+    desc->boardloc = ((pkt_data[5] << 8) & 0xff00) 
+                        | (pkt_data[4] & 0x00ff);
+    desc->pktUTC = ((pkt_data[9] << 24) & 0xff000000) 
+                        | ((pkt_data[8] << 16) & 0x00ff0000)
+                        | ((pkt_data[7] << 8) & 0x0000ff00)
+                        | ((pkt_data[6]) & 0x000000ff);
+                        
+    desc->pktNSEC = ((pkt_data[13] << 24) & 0xff000000) 
+                        | ((pkt_data[12] << 16) & 0x00ff0000)
+                        | ((pkt_data[11] << 8) & 0x0000ff00)
+                        | ((pkt_data[10]) & 0x000000ff);
+
+}
+
+/**
+ * Store the packet in the input block at the given index. The header is parsed,
+ * the data is copied and the packet is time stamped.
+ * @param block The input block to be written to
+ * @param i The index of the packet within the input block
+ * @param pkt_data The UDP payload of the packet
+ * @param recv_ns The receive time of the packet in ns since the epoch
+ */
+static inline void HSD_input_block_store(HSD_input_block_t* block, int i, const unsigned char* pkt_data, uint64_t recv_ns){
+    HSD_input_block_header_t* blockHeader = &(block->header);
+    HSD_pkt_desc_t* desc = &(blockHeader->pkt[i]);
+
+    get_header(pkt_data, desc);
+
+    //Copy the packets in PKTSOCK to the input circular buffer
+    //Size is based on whether or not the mode is 16 bit or 8 bit
+    if (desc->acqmode < 4){
+        memcpy(block->data_block+i*PKTDATASIZE, pkt_data+16, PKTDATASIZE*sizeof(unsigned char));
+    } else {
+        memcpy(block->data_block+i*PKTDATASIZE, pkt_data+16, BIT8PKTDATASIZE*sizeof(unsigned char));
+    }
+
+    //Time stamping the packets and passing it into the shared buffer
+    desc->recvTime = recv_ns;
+
+    blockHeader->data_block_size++;
+}
+
 /*
  * OUTPUT BUFFER FUNCTIONS FROM HASHPIPE LIBRARY
  */
 
 hashpipe_databuf_t *HSD_output_databuf_create(int instance_id, int databuf_id);
 
+/**
+ * Size of the data of a module pair frame of the given bit depth (16 or 8).
+ */
+static inline unsigned int HSD_modpair_data_size(int mode){
+    return PKTPERPAIR*SCIDATASIZE*(mode/8);
+}
+
+/**
+ * Pointer to the data of the i-th module pair frame in the output block.
+ */
+static inline char *HSD_output_stream_record(HSD_output_block_t *block, int i){
+    return block->stream_block + block->header.stream_offset[i];
+}
+
+/**
+ * Pointer to the data of the i-th PH packet in the output block.
+ */
+static inline char *HSD_output_coinc_record(HSD_output_block_t *block, int i){
+    return block->coinc_block + block->header.coin_offset[i];
+}
+
 //Output databuf clear
 static inline void HSD_output_databuf_clear(HSD_output_databuf_t *d){
     hashpipe_databuf_clear((hashpipe_databuf_t *)d);
@@ -253,3 +384,5 @@ static inline int HSD_output_databuf_set_free(HSD_output_databuf_t *d, int block
 static inline int HSD_output_databuf_set_filled(HSD_output_databuf_t *d, int block_id){
     return hashpipe_databuf_set_filled((hashpipe_databuf_t *)d, block_id);
 }
+
+#endif
@@ -0,0 +1,8 @@
+#!/bin/bash
+# Start one hashpipe instance per receive shard. All instances join the same
+# PACKET_FANOUT group and every module pair is steered to a single instance.
+NSHARDS=${1:-2}
+for ((i=0; i<NSHARDS; i++)); do
+    hashpipe -p HSD_hashpipe -I $i -o BINDHOST="0.0.0.0" -o FANOUTID=1 -o MAXFILESIZE=500 -o SAVELOC="/media/panosetigraph/4TB_SSD" HSD_net_thread HSD_compute_thread  HSD_output_thread &
+done
+wait
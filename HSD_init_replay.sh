@@ -0,0 +1,8 @@
+#!/bin/bash
+# Replay a capture file recorded with NETCAPF through the pipeline instead of
+# receiving from the quabos. REPLRATE=1 keeps the original timing, larger
+# values speed it up and 0 replays as fast as possible.
+REPLFILE=${1:?usage: $0 capture.pcap [rate] [passes]}
+REPLRATE=${2:-1}
+REPLLOOP=${3:-1}
+hashpipe -p HSD_hashpipe -I 0 -o REPLFILE="$REPLFILE" -o REPLRATE=$REPLRATE -o REPLLOOP=$REPLLOOP -o MAXFILESIZE=500 -o SAVELOC="/media/panosetigraph/4TB_SSD" HSD_replay_thread HSD_compute_thread  HSD_output_thread
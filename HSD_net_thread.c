@@ -18,15 +18,257 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include "hashpipe.h"
 #include "HSD_databuf.h"
+#include "HSD_netsock.h"
+#include "HSD_capture.h"
 
 //PKTSOCK Params(These should be only changed with caution as it need to change with MMAP)
+//These are the defaults of the PKTFRMSZ, PKTBLKFR and PKTNBLKS status keys.
 #define PKTSOCK_BYTES_PER_FRAME (16384)
 #define PKTSOCK_FRAMES_PER_BLOCK (8)
 #define PKTSOCK_NBLOCKS (20)
 #define PKTSOCK_NFRAMES (PKTSOCK_FRAMES_PER_BLOCK * PKTSOCK_NBLOCKS)
 
+//Smallest frame that holds the ring header and a full 16 bit quabo packet
+#define PKTSOCK_MIN_BYTES_PER_FRAME TPACKET_ALIGN(TPACKET_ALIGN(TPACKET3_HDRLEN) + 16 \
+                                    + ETH_HLEN + PKT3_UDP_OFFSET + HEADERSIZE + PKTDATASIZE)
+
+/**
+ * The geometry of the packet socket ring.
+ */
+typedef struct net_ring {
+    int frame_size;         //Bytes per frame
+    int frames_per_block;   //Frames per ring block
+    int nblocks;            //Number of ring blocks
+} net_ring_t;
+
+//Receive modes of the net thread selected by NETMODE
+#define NETRXMODE_FRAME     0       //One frame at a time from the hashpipe pktsock
+#define NETRXMODE_BLOCK     1       //One retired TPACKET_V3 ring block at a time
+#define NETRXMODE_XDP       2       //Batches of the AF_XDP rx ring of one queue
+#define NETRXMODE_UDP       3       //recvmmsg() batches of an unprivileged UDP socket
+
+/**
+ * The socket state of the net thread. Only the socket of the selected
+ * receive mode is opened.
+ */
+typedef struct net_socket {
+    int rxmode;
+    struct hashpipe_pktsock pktsock;
+    HSD_pktsock_v3_t pktsock_v3;
+    HSD_xsk_t xsk;
+    HSD_udpsock_t udpsock;
+} net_socket_t;
+
+/**
+ * Close the socket that was opened for the selected receive mode.
+ */
+static void net_socket_close(void *arg){
+    net_socket_t *p_sock = (net_socket_t *)arg;
+    if (p_sock->rxmode == NETRXMODE_BLOCK){
+        HSD_pktsock_v3_close(&(p_sock->pktsock_v3));
+    } else if (p_sock->rxmode == NETRXMODE_XDP){
+        HSD_xsk_close(&(p_sock->xsk));
+    } else if (p_sock->rxmode == NETRXMODE_UDP){
+        HSD_udpsock_close(&(p_sock->udpsock));
+    } else {
+        hashpipe_pktsock_close(&(p_sock->pktsock));
+    }
+}
+
+/**
+ * The fd of the socket that was opened for the selected receive mode.
+ */
+static int net_socket_fd(net_socket_t *p_sock){
+    if (p_sock->rxmode == NETRXMODE_BLOCK) return p_sock->pktsock_v3.fd;
+    if (p_sock->rxmode == NETRXMODE_XDP) return p_sock->xsk.fd;
+    if (p_sock->rxmode == NETRXMODE_UDP) return p_sock->udpsock.fd;
+    return p_sock->pktsock.fd;
+}
+
+/**
+ * Close the capture file if one was opened.
+ */
+static void net_capture_close(void *arg){
+    HSD_capture_t *cap = (HSD_capture_t *)arg;
+    if (cap->fp){
+        printf("Captured %lu packets\n", cap->npkts);
+        HSD_capture_close(cap);
+    }
+}
+
+//Wait policies of the net thread selected by NETWAIT
+#define NETWAIT_BUSY        0       //Busy poll the ring until a packet arrives
+#define NETWAIT_SPIN        1       //Busy poll for NETSPIN us and then sleep in poll()
+#define NETWAIT_SLEEP       2       //Sleep in poll() as soon as the ring is empty
+#define NETWAIT_DEFAULT_SPIN_US     100
+#define NETWAIT_POLL_TIMEOUT_MS     100     //Upper bound of a poll() so that shutdown is noticed
+#define NETFLUSH_NONE               0       //No flush deadline for the current input block
+
+//Receive time sources of the packets selected by NETTSRC
+#define NETTSRC_KERNEL      0       //Time the kernel received the packet from the ring header
+#define NETTSRC_BATCH       1       //One clock read per batch of packets taken from the ring
+#define NETTSRC_PACKET      2       //One clock read per packet when it is copied
+
+//Socket filters for the NETFILT status key
+#define NETFILT_NONE        0       //No filter, every packet reaches the ring
+#define NETFILT_ACQMODE     1       //UDP to BINDPORT with a recognized acqmode
+#define NETFILT_MODULE      2       //NETFILT_ACQMODE and only the modules in the config file
+
+/**
+ * The wait state of the net thread while the ring is empty. The time spent
+ * spinning and sleeping is accumulated so that the policy can be tuned.
+ */
+typedef struct net_wait {
+    int policy;
+    uint64_t spin_ns;       //Time to busy poll before sleeping in SPIN policy
+    uint64_t start_ns;      //Start of the current wait
+    uint64_t slept_ns;      //Time slept during the current wait
+    uint64_t spinning_ns;   //Total time spent busy polling
+    uint64_t sleeping_ns;   //Total time spent sleeping in poll()
+    uint64_t npolls;        //Number of poll() calls
+} net_wait_t;
+
+/**
+ * Read the monotonic clock in ns.
+ */
+static inline uint64_t monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Check that the ring geometry can be mapped by the kernel. Frames must be
+ * aligned and hold a full quabo packet, and ring blocks must be a whole
+ * number of pages.
+ * @param ring The ring geometry from the status buffer
+ * @return 1 if the geometry is valid and 0 otherwise
+ */
+static int net_ring_valid(const net_ring_t *ring){
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (ring->frame_size < (int)PKTSOCK_MIN_BYTES_PER_FRAME || ring->frame_size % TPACKET_ALIGNMENT){
+        printf("Warning: PKTFRMSZ %i must be a multiple of %i of at least %i bytes.\n",
+                ring->frame_size, TPACKET_ALIGNMENT, (int)PKTSOCK_MIN_BYTES_PER_FRAME);
+        return 0;
+    }
+    if (ring->frames_per_block < 1 || ((long)ring->frame_size * ring->frames_per_block) % page_size){
+        printf("Warning: PKTFRMSZ*PKTBLKFR %li must be a multiple of the %li byte page size.\n",
+                (long)ring->frame_size * ring->frames_per_block, page_size);
+        return 0;
+    }
+    if (ring->nblocks < 1){
+        printf("Warning: PKTNBLKS %i must be at least 1.\n", ring->nblocks);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Parse the NETWAIT string into a wait policy.
+ */
+static int parse_wait_policy(const char *policy){
+    if (!strcmp(policy, "SPIN")) return NETWAIT_SPIN;
+    if (!strcmp(policy, "SLEEP")) return NETWAIT_SLEEP;
+    if (strcmp(policy, "BUSY")){
+        printf("Warning: Unknown NETWAIT %s. Using BUSY.\n", policy);
+    }
+    return NETWAIT_BUSY;
+}
+
+/**
+ * Read the realtime clock in ns since the epoch.
+ */
+static inline uint64_t realtime_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Parse the NETTSRC string into a time source.
+ */
+static int parse_time_source(const char *source){
+    if (!strcmp(source, "BATCH")) return NETTSRC_BATCH;
+    if (!strcmp(source, "PACKET")) return NETTSRC_PACKET;
+    if (strcmp(source, "KERNEL")){
+        printf("Warning: Unknown NETTSRC %s. Using KERNEL.\n", source);
+    }
+    return NETTSRC_KERNEL;
+}
+
+/**
+ * Parse the NETFILT string into a socket filter.
+ */
+static int parse_filter(const char *filter){
+    if (!strcmp(filter, "NONE")) return NETFILT_NONE;
+    if (!strcmp(filter, "MODULE")) return NETFILT_MODULE;
+    if (strcmp(filter, "ACQMODE")){
+        printf("Warning: Unknown NETFILT %s. Using ACQMODE.\n", filter);
+    }
+    return NETFILT_ACQMODE;
+}
+
+/**
+ * Mark the start of a wait on an empty ring.
+ */
+static inline void net_wait_begin(net_wait_t *wait){
+    wait->start_ns = monotonic_ns();
+    wait->slept_ns = 0;
+}
+
+/**
+ * Check if the flush deadline of a partially filled input block has passed.
+ * @param deadline The monotonic flush deadline in ns or NETFLUSH_NONE
+ */
+static inline int net_flush_due(uint64_t deadline){
+    return deadline != NETFLUSH_NONE && monotonic_ns() >= deadline;
+}
+
+/**
+ * Idle once while the ring is empty according to the wait policy.
+ * @param wait The wait state of the net thread
+ * @param fd The socket that is polled when sleeping
+ * @param deadline The flush deadline that bounds the sleep or NETFLUSH_NONE
+ */
+static inline void net_wait_idle(net_wait_t *wait, int fd, uint64_t deadline){
+    if (wait->policy == NETWAIT_BUSY) return;
+    if (wait->policy == NETWAIT_SPIN &&
+        monotonic_ns() - wait->start_ns - wait->slept_ns < wait->spin_ns) return;
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN | POLLRDNORM | POLLERR;
+    pfd.revents = 0;
+
+    uint64_t sleep_start = monotonic_ns();
+    uint64_t timeout_ns = NETWAIT_POLL_TIMEOUT_MS * 1000000ULL;
+    if (deadline != NETFLUSH_NONE){
+        uint64_t remaining = (deadline > sleep_start) ? deadline - sleep_start : 0;
+        if (remaining < timeout_ns) timeout_ns = remaining;
+    }
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ns / 1000000000ULL;
+    timeout.tv_nsec = timeout_ns % 1000000000ULL;
+
+    ppoll(&pfd, 1, &timeout, NULL);
+    uint64_t slept = monotonic_ns() - sleep_start;
+
+    wait->slept_ns += slept;
+    wait->sleeping_ns += slept;
+    wait->npolls++;
+}
+
+/**
+ * Mark the end of a wait on an empty ring and account for the spinning time.
+ */
+static inline void net_wait_end(net_wait_t *wait){
+    wait->spinning_ns += monotonic_ns() - wait->start_ns - wait->slept_ns;
+}
+
 //DEBUGGING MODE 
 //#define TEST_MODE
 
@@ -34,9 +276,23 @@ static int init(hashpipe_thread_args_t * args){
     printf("\n\n-----------Start Setup of Input Thread--------------\n");
     // define default network params
     char bindhost[80];
+    char rxmode[80];
+    char waitpolicy[80];
+    char timesource[80];
     int bindport = 60001;
+    int spinus = NETWAIT_DEFAULT_SPIN_US;
+    int fanoutid = 0;
+    int flushus = 0;
+    int queueid = 0;
+    int rcvbuf = 0;
+    net_ring_t ring = {PKTSOCK_BYTES_PER_FRAME, PKTSOCK_FRAMES_PER_BLOCK, PKTSOCK_NBLOCKS};
+    char filter[80];
     hashpipe_status_t st = args->st;
     strcpy(bindhost, "0.0.0.0");
+    strcpy(rxmode, "FRAME");
+    strcpy(waitpolicy, "BUSY");
+    strcpy(timesource, "KERNEL");
+    strcpy(filter, "ACQMODE");
 
     //Locking shared buffer to properly get and set values.
     hashpipe_status_lock_safe(&st);
@@ -44,43 +300,148 @@ static int init(hashpipe_thread_args_t * args){
     // Get info from status buffer if present
     hgets(st.buf, "BINDHOST", 80, bindhost);
     hgeti4(st.buf, "BINDPORT", &bindport);
+    hgets(st.buf, "NETMODE", 80, rxmode);
+    hgets(st.buf, "NETWAIT", 80, waitpolicy);
+    hgeti4(st.buf, "NETSPIN", &spinus);
+    hgeti4(st.buf, "FANOUTID", &fanoutid);
+    hgets(st.buf, "NETTSRC", 80, timesource);
+    hgeti4(st.buf, "NETFLUSH", &flushus);
+    hgets(st.buf, "NETFILT", 80, filter);
+    hgeti4(st.buf, "NETQUEUE", &queueid);
+    hgeti4(st.buf, "NETRCVBF", &rcvbuf);
+    hgeti4(st.buf, "PKTFRMSZ", &(ring.frame_size));
+    hgeti4(st.buf, "PKTBLKFR", &(ring.frames_per_block));
+    hgeti4(st.buf, "PKTNBLKS", &(ring.nblocks));
+
+    if (!net_ring_valid(&ring)){
+        printf("Warning: Invalid packet ring geometry. Using the defaults.\n");
+        ring.frame_size = PKTSOCK_BYTES_PER_FRAME;
+        ring.frames_per_block = PKTSOCK_FRAMES_PER_BLOCK;
+        ring.nblocks = PKTSOCK_NBLOCKS;
+    }
 
     //Store bind host/port info and other info in status buffer
     hputs(st.buf, "BINDHOST", bindhost);
 	hputi4(st.buf, "BINDPORT", bindport);
+    hputs(st.buf, "NETMODE", rxmode);
+    hputs(st.buf, "NETWAIT", waitpolicy);
+    hputi4(st.buf, "NETSPIN", spinus);
+    hputi4(st.buf, "FANOUTID", fanoutid);
+    hputs(st.buf, "NETTSRC", timesource);
+    hputi4(st.buf, "NETFLUSH", flushus);
+    hputs(st.buf, "NETFILT", filter);
+    hputi4(st.buf, "NETQUEUE", queueid);
+    hputi4(st.buf, "NETRCVBF", rcvbuf);
+    hputi4(st.buf, "PKTFRMSZ", ring.frame_size);
+    hputi4(st.buf, "PKTBLKFR", ring.frames_per_block);
+    hputi4(st.buf, "PKTNBLKS", ring.nblocks);
     hputi8(st.buf, "NPACKETS", 0);
 
     //Unlocking shared buffer once complete.
     hashpipe_status_unlock_safe(&st);
 
     // Set up pktsocket
-    struct hashpipe_pktsock *p_ps = (struct hashpipe_pktsock *)
-    malloc(sizeof(struct hashpipe_pktsock));
+    net_socket_t *p_sock = (net_socket_t *)malloc(sizeof(net_socket_t));
 
-    if(!p_ps) {
+    if(!p_sock) {
         perror(__FUNCTION__);
         return -1;
     }
 
-    /* Make frame_size be a divisor of block size so that frames will be
-	contiguous in mapped mempory.  block_size must also be a multiple of
-	page_size.  Easiest way is to oversize the frames to be 16384 bytes, which
-	is bigger than we need, but keeps things easy. */
-	p_ps->frame_size = PKTSOCK_BYTES_PER_FRAME;
-	// total number of frames
-	p_ps->nframes = PKTSOCK_NFRAMES;
-	// number of blocks
-	p_ps->nblocks = PKTSOCK_NBLOCKS;
-
-    //Opening Pktsocket to recieve data.
-    int rv = hashpipe_pktsock_open(p_ps, bindhost, PACKET_RX_RING);
+    int rv;
+    if (!strcmp(rxmode, "BLOCK") || !strcmp(rxmode, "FRAME")){
+        printf("Packet ring: %i blocks of %i frames of %i bytes (%li bytes)\n",
+                ring.nblocks, ring.frames_per_block, ring.frame_size,
+                (long)ring.nblocks * ring.frames_per_block * ring.frame_size);
+    }
+    if (!strcmp(rxmode, "BLOCK")){
+        //Block mode receives whole retired ring blocks from a TPACKET_V3 ring
+        //with the same geometry as the frame mode ring.
+        p_sock->rxmode = NETRXMODE_BLOCK;
+        printf("Receive Mode: TPACKET_V3 blocks\n");
+
+        //Packets are only seen once their ring block retires, so the retire
+        //timeout must not be longer than the flush deadline.
+        unsigned int timeout_ms = PKTSOCK_V3_BLOCK_TIMEOUT_MS;
+        if (flushus > 0 && (unsigned int)flushus / 1000 < timeout_ms){
+            timeout_ms = (flushus < 1000) ? 1 : flushus / 1000;
+        }
+        rv = HSD_pktsock_v3_open(&(p_sock->pktsock_v3), bindhost, ring.frame_size,
+                                ring.frames_per_block, ring.nblocks, timeout_ms);
+    } else if (!strcmp(rxmode, "XDP") || !strcmp(rxmode, "XDPZC")){
+        //XDP mode receives the packets of a single queue of the interface with an
+        //AF_XDP socket. The packets must be steered to that queue, e.g. with an
+        //ethtool ntuple rule, or the interface must have a single queue. The instances
+        //on the interface share one XDP program whose XSKMAP holds the socket of each queue.
+        p_sock->rxmode = NETRXMODE_XDP;
+        int zerocopy = !strcmp(rxmode, "XDPZC");
+        printf("Receive Mode: AF_XDP %s\n", zerocopy ? "zero-copy" : "copy");
+        rv = HSD_xsk_open(&(p_sock->xsk), bindhost, queueid, bindport,
+                          XSK_FRAME_SIZE, XSK_NFRAMES, zerocopy);
+    } else if (!strcmp(rxmode, "UDP")){
+        //UDP mode receives from a normal UDP socket bound to BINDPORT, which needs
+        //no privileges and also works on loopback. BINDHOST is the address to bind.
+        p_sock->rxmode = NETRXMODE_UDP;
+        printf("Receive Mode: UDP socket recvmmsg\n");
+        rv = HSD_udpsock_open(&(p_sock->udpsock), bindhost, bindport, rcvbuf, UDPSOCK_BATCH);
+        if (rv == HASHPIPE_OK){
+            printf("UDP socket receive buffer: %i bytes\n", HSD_udpsock_rcvbuf(&(p_sock->udpsock)));
+        }
+    } else {
+        if (strcmp(rxmode, "FRAME")){
+            printf("Warning: Unknown NETMODE %s. Using FRAME.\n", rxmode);
+        }
+        p_sock->rxmode = NETRXMODE_FRAME;
+        printf("Receive Mode: pktsock frames\n");
+
+        /* Make frame_size be a divisor of block size so that frames will be
+        contiguous in mapped mempory.  block_size must also be a multiple of
+        page_size.  The default oversizes the frames to be 16384 bytes, which
+        is bigger than we need, but keeps things easy. A 1024 byte frame fits
+        a quabo packet and gives a 16x deeper ring for the same memory. */
+        p_sock->pktsock.frame_size = ring.frame_size;
+        // total number of frames
+        p_sock->pktsock.nframes = ring.frames_per_block * ring.nblocks;
+        // number of blocks
+        p_sock->pktsock.nblocks = ring.nblocks;
+
+        //Opening Pktsocket to recieve data.
+        rv = hashpipe_pktsock_open(&(p_sock->pktsock), bindhost, PACKET_RX_RING);
+    }
 	if (rv!=HASHPIPE_OK) {
         hashpipe_error("HSD_net_thread", "Error opening pktsock.");
         pthread_exit(NULL);
 	}
 
+    //Drop non-science packets in the kernel before they take a ring slot.
+    //The XDP program and the UDP socket already only see the packets to BINDPORT.
+    int filt = parse_filter(filter);
+    if (filt != NETFILT_NONE && p_sock->rxmode != NETRXMODE_XDP && p_sock->rxmode != NETRXMODE_UDP){
+        int fd = net_socket_fd(p_sock);
+        if (HSD_netsock_attach_filter(fd, bindport, (filt == NETFILT_MODULE) ? CONFIGFILE : NULL) != HASHPIPE_OK){
+            hashpipe_error("HSD_net_thread", "Error attaching socket filter.");
+            pthread_exit(NULL);
+        }
+    }
+
+    //Every hashpipe instance started with the same FANOUTID shares the packets
+    //of the interface, with each module pair steered to a single instance.
+    //In XDP mode every instance binds its own NETQUEUE instead and adds its socket
+    //to the XSKMAP of the XDP program that the first instance attached.
+    if (fanoutid > 0 && p_sock->rxmode == NETRXMODE_XDP){
+        printf("Warning: FANOUTID is ignored in XDP mode. Use NETQUEUE to shard.\n");
+    } else if (fanoutid > 0 && p_sock->rxmode == NETRXMODE_UDP){
+        printf("Warning: FANOUTID is ignored in UDP mode.\n");
+    } else if (fanoutid > 0){
+        int fd = net_socket_fd(p_sock);
+        if (HSD_netsock_join_fanout(fd, fanoutid, CONFIGFILE) != HASHPIPE_OK){
+            hashpipe_error("HSD_net_thread", "Error joining fanout group.");
+            pthread_exit(NULL);
+        }
+    }
+
     // Store packet socket pointer in args
-	args->user_data = p_ps;
+	args->user_data = p_sock;
 
     
     // Initialize the the starting values of the input buffer.
@@ -105,6 +466,16 @@ typedef struct {
 }packet_header_t;
 
 
+/**
+ * Check if the acqmode is one of the recognized modes (1,2,3,6,7).
+ * @param acqmode The acqmode byte of the packet
+ * @return 1 if acqmode is recognized and 0 otherwise
+ */
+static inline int valid_acqmode(unsigned char acqmode){
+    return acqmode == 1 || acqmode == 2 || acqmode == 3 ||
+           acqmode == 6 || acqmode == 7;
+}
+
 /**
  * Check the acqmode of the packet coming in. Returns True if it is valid and returns
  * false if it is an acqmode that is not recognized.
@@ -115,36 +486,183 @@ typedef struct {
 int check_acqmode(unsigned char* p_frame){
     if (!p_frame) return 0;
     unsigned char* pkt_data = PKT_UDP_DATA(p_frame);
-    if (pkt_data[0] == 1 || pkt_data[0] == 2 || pkt_data[0] == 3 ||
-        pkt_data[0] == 6 || pkt_data[0] == 7){
+    if (valid_acqmode(pkt_data[0])){
             return 1;
         }
     hashpipe_pktsock_release_frame(p_frame);
     return 0;
 }
 
+//Sequence tracking of the packet numbers of every quabo
+#define NETSEQ_MAX_QUABOS       1024    //Max number of quabos tracked by the net thread
+#define NETSEQ_NMODES           5       //Number of recognized acqmodes (1,2,3,6,7)
+#define NETSEQ_WINDOW           64      //Packet numbers behind the expected one that are remembered
+#define NETSEQ_UNSEEN           0xffff  //Boardloc slot of a quabo that has not been seen
+#define NETSEQ_PUBLISH_NS       1000000000ULL   //Interval of the per quabo status keys
+
 /**
- * Get the header info of the first packet in the PKTSOCK buffer
- * @param p_frame The pointer for the packet frame(returned from PKT_UDP_DATA(p_frame))
- * @param pkt_header The header struct to be written to
+ * Sequence state of one acqmode of a quabo. The window has bit k set if
+ * packet number expected-1-k was received.
+ */
+typedef struct net_seq_mode {
+    uint16_t expected;      //Next packet number in order
+    uint8_t started;        //A packet of this acqmode has been received
+    uint64_t window;
+} net_seq_mode_t;
+
+/**
+ * Arrival counters of one quabo summed over its acqmodes.
+ */
+typedef struct net_seq_quabo {
+    uint16_t boardloc;
+    net_seq_mode_t mode[NETSEQ_NMODES];
+    uint64_t npkts;         //Packets received
+    uint64_t lost;          //Packet numbers skipped and not received since
+    uint64_t dups;          //Packet numbers received more than once
+    uint64_t reorders;      //Packets received after a later packet number
+    uint64_t restarts;      //Packet numbers that jumped back beyond the window, e.g. after a reboot
+} net_seq_quabo_t;
+
+/**
+ * Dense table of the sequence state of every quabo seen by the net thread,
+ * indexed by boardloc through a slot map.
+ */
+typedef struct net_seq {
+    uint16_t slot[0x10000];
+    int nquabos;
+    net_seq_quabo_t quabo[NETSEQ_MAX_QUABOS];
+    uint64_t lost;
+    uint64_t dups;
+    uint64_t reorders;
+    uint64_t restarts;
+} net_seq_t;
+
+/**
+ * Index of a recognized acqmode in the sequence state.
+ */
+static inline int net_seq_mode_index(unsigned char acqmode){
+    switch (acqmode){
+        case 1: return 0;
+        case 2: return 1;
+        case 3: return 2;
+        case 6: return 3;
+        default: return 4;
+    }
+}
+
+/**
+ * Initialize an empty sequence table.
+ */
+static void net_seq_init(net_seq_t *seq){
+    memset(seq, 0, sizeof(*seq));
+    memset(seq->slot, 0xff, sizeof(seq->slot));
+}
+
+/**
+ * Classify the packet number of an arriving packet against the expected packet
+ * number of its quabo and acqmode. Packet numbers ahead of the expected one
+ * are counted as lost until they arrive late as reorders. Packet numbers behind
+ * it are duplicates if they were already received within the window. A packet
+ * number further behind than the window means the quabo restarted its count,
+ * so the expected packet number is resynced to it.
+ * @param seq The sequence table
+ * @param acqmode The acqmode of the packet
+ * @param boardloc The boardloc of the quabo
+ * @param pktNum The packet number of the packet
+ */
+static inline void net_seq_track(net_seq_t *seq, unsigned char acqmode, uint16_t boardloc, uint16_t pktNum){
+    uint16_t slot = seq->slot[boardloc];
+    if (slot == NETSEQ_UNSEEN){
+        if (seq->nquabos >= NETSEQ_MAX_QUABOS) return;
+        slot = seq->nquabos++;
+        seq->slot[boardloc] = slot;
+        seq->quabo[slot].boardloc = boardloc;
+    }
+    net_seq_quabo_t *quabo = &(seq->quabo[slot]);
+    net_seq_mode_t *mode = &(quabo->mode[net_seq_mode_index(acqmode)]);
+    quabo->npkts++;
+
+    if (!mode->started){
+        mode->started = 1;
+        mode->expected = pktNum + 1;
+        mode->window = 1;
+        return;
+    }
+
+    uint16_t ahead = pktNum - mode->expected;
+    if (ahead < 0x8000){
+        //In order or ahead of the expected packet number by the skipped packets
+        quabo->lost += ahead;
+        seq->lost += ahead;
+        mode->window = (ahead + 1 >= NETSEQ_WINDOW) ? 1 : (mode->window << (ahead + 1)) | 1;
+        mode->expected = pktNum + 1;
+        return;
+    }
+
+    uint16_t behind = mode->expected - 1 - pktNum;
+    if (behind >= NETSEQ_WINDOW){
+        quabo->restarts++;
+        seq->restarts++;
+        mode->expected = pktNum + 1;
+        //Nothing before the new count was counted lost, so a late packet must not be a reorder
+        mode->window = ~0ULL;
+    } else if ((mode->window >> behind) & 1){
+        quabo->dups++;
+        seq->dups++;
+    } else {
+        //A late packet that was counted as lost when a later one arrived
+        quabo->reorders++;
+        seq->reorders++;
+        mode->window |= 1ULL << behind;
+        quabo->lost--;
+        seq->lost--;
+    }
+}
+
+/**
+ * Publish the arrival counters of every quabo as NL<boardloc> (lost),
+ * ND<boardloc> (duplicates), NR<boardloc> (reorders) and NS<boardloc>
+ * (restarts). The status buffer
+ * must be locked by the caller.
+ */
+static void net_seq_publish(net_seq_t *seq, char *buf){
+    char key[16];
+    for (int i = 0; i < seq->nquabos; i++){
+        net_seq_quabo_t *quabo = &(seq->quabo[i]);
+        sprintf(key, "NL%05u", quabo->boardloc);
+        hputu8(buf, key, quabo->lost);
+        sprintf(key, "ND%05u", quabo->boardloc);
+        hputu8(buf, key, quabo->dups);
+        sprintf(key, "NR%05u", quabo->boardloc);
+        hputu8(buf, key, quabo->reorders);
+        sprintf(key, "NS%05u", quabo->boardloc);
+        hputu8(buf, key, quabo->restarts);
+    }
+}
+
+/**
+ * Store the packet in the input block at the given index, track its packet
+ * number and record it in the capture file if one is open. The capture file
+ * is closed at the first failed write, e.g. when the disk is full.
+ * @param block The input block to be written to
+ * @param i The index of the packet within the input block
+ * @param pkt_data The UDP payload of the packet
+ * @param recv_ns The receive time of the packet in ns since the epoch
+ * @param seq The sequence table the packet number is tracked in
+ * @param cap The capture file or NULL
  */
-static inline void get_header(unsigned char* pkt_data, int i, HSD_input_block_header_t* pkt_header) {
-    pkt_header->acqmode[i] = pkt_data[0];
-    pkt_header->pktNum[i] = ((pkt_data[3] << 8) & 0xff00) 
-                        | (pkt_data[2] & 0x00ff);
-    pkt_header->modNum[i] = ((pkt_data[5] << 6) & 0x3fc0) 
-                        | ((pkt_data[4] >> 2) & 0x003f);
-    pkt_header->quaNum[i] = ((pkt_data[4]) & 0x03);
-    pkt_header->pktUTC[i] = ((pkt_data[9] << 24) & 0xff000000) 
-                        | ((pkt_data[8] << 16) & 0x00ff0000)
-                        | ((pkt_data[7] << 8) & 0x0000ff00)
-                        | ((pkt_data[6]) & 0x000000ff);
-                        
-    pkt_header->pktNSEC[i] = ((pkt_data[13] << 24) & 0xff000000) 
-                        | ((pkt_data[12] << 16) & 0x00ff0000)
-                        | ((pkt_data[11] << 8) & 0x0000ff00)
-                        | ((pkt_data[10]) & 0x000000ff);
+static inline void store_packet(HSD_input_block_t* block, int i, unsigned char* pkt_data, uint64_t recv_ns,
+                                net_seq_t* seq, HSD_capture_t* cap){
+    HSD_pkt_desc_t* desc = &(block->header.pkt[i]);
 
+    HSD_input_block_store(block, i, pkt_data, recv_ns);
+    net_seq_track(seq, desc->acqmode, desc->boardloc, desc->pktNum);
+    if (cap && cap->fp){
+        if (HSD_capture_write(cap, recv_ns, pkt_data, HSD_packet_size(pkt_data[0])) != HASHPIPE_OK){
+            printf("Warning: Unable to write to the capture file after %lu packets. Capture stopped.\n", cap->npkts);
+            HSD_capture_close(cap);
+        }
+    }
 }
 
 static int INTSIG;
@@ -172,39 +690,116 @@ static void *run(hashpipe_thread_args_t * args){
     HSD_input_block_header_t* blockHeader;
     packet_header_t pkt_header; //Current packet's header
     unsigned char* pkt_data;    //Packet Data from PKT_UDP_DATA
-    struct timeval nowTime;     //Current NTP UTC time
-    int rc;                     
 
     //Compute the pkt_loss in the compute thread
     unsigned int pktsock_pkts = 0;      // Stats counter for socket packet
     unsigned int pktsock_drops = 0;     // Stats counter for dropped socket packet
+    unsigned int pktsock_freezes = 0;   // Stats counter for ring freezes in block mode
     uint64_t npackets = 0;              // number of received packets
     int bindport = 0;
+    char waitpolicy[80];
+    char timesource[80];
+    char capfile[256];                  // Capture file of the received packets
+    int spinus = NETWAIT_DEFAULT_SPIN_US;
+    int flushus = 0;
+    uint64_t flush_deadline;            // Deadline to hand a partially filled block downstream
+    uint64_t nflushes = 0;              // Number of partially filled blocks handed downstream
+    uint64_t nrunts = 0;                // Number of packets dropped for being shorter than their acqmode
+    int tsrc;                           // Source of the receive time of the packets
+    uint64_t batch_ns = 0;              // Receive time of the current batch of packets
+    uint64_t recv_ns;                   // Receive time of the current packet
+    net_wait_t wait;                    // Wait state while the ring is empty
+    uint64_t recv_start;                // Start of filling the current block
+    uint64_t recv_waited;               // Wait time accumulated before filling the current block
+    uint64_t working_ns = 0;            // Total time spent handling packets
+    strcpy(waitpolicy, "BUSY");
+    strcpy(timesource, "KERNEL");
+    capfile[0] = '\0';
 
     hashpipe_status_lock_safe(&st);
 	// Get info from status buffer if present (no change if not present)
 	hgeti4(st.buf, "BINDPORT", &bindport);
+	hgets(st.buf, "NETWAIT", 80, waitpolicy);
+	hgeti4(st.buf, "NETSPIN", &spinus);
+	hgets(st.buf, "NETTSRC", 80, timesource);
+	hgeti4(st.buf, "NETFLUSH", &flushus);
+	hgets(st.buf, "NETCAPF", sizeof(capfile), capfile);
 	hputs(st.buf, status_key, "running");
 	hashpipe_status_unlock_safe(&st);
 
+    memset(&wait, 0, sizeof(wait));
+    wait.policy = parse_wait_policy(waitpolicy);
+    wait.spin_ns = (uint64_t)spinus * 1000;
+    tsrc = parse_time_source(timesource);
+    int pkts_per_block = HSD_input_pkts_per_block(&st);  // Packets put in each input block
+
     // Get pktsock from args
-	struct hashpipe_pktsock * p_ps = (struct hashpipe_pktsock*)args->user_data;
-	pthread_cleanup_push(free, p_ps);
-	pthread_cleanup_push((void (*)(void *))hashpipe_pktsock_close, p_ps);
+	net_socket_t *p_sock = (net_socket_t *)args->user_data;
+	struct hashpipe_pktsock * p_ps = &(p_sock->pktsock);
+	HSD_pktsock_v3_t * p_ps3 = &(p_sock->pktsock_v3);
+	HSD_xsk_t * p_xsk = &(p_sock->xsk);
+	HSD_udpsock_t * p_us = &(p_sock->udpsock);
+	pthread_cleanup_push(free, p_sock);
+	pthread_cleanup_push(net_socket_close, p_sock);
+
+	// Sequence table of the packet numbers of every quabo
+	net_seq_t *seq = (net_seq_t *)malloc(sizeof(net_seq_t));
+	if (!seq) {
+		hashpipe_error(__FUNCTION__, "error allocating sequence table");
+		pthread_exit(NULL);
+	}
+	net_seq_init(seq);
+	uint64_t seq_published = monotonic_ns();
+	pthread_cleanup_push(free, seq);
+
+	// Record every stored packet with its receive time when NETCAPF is set
+	HSD_capture_t capture;
+	HSD_capture_t *cap = NULL;
+	memset(&capture, 0, sizeof(capture));
+	if (capfile[0]) {
+		if (HSD_capture_create(&capture, capfile) != HASHPIPE_OK) {
+			hashpipe_error(__FUNCTION__, "error creating capture file");
+			pthread_exit(NULL);
+		}
+		printf("Capturing packets to %s\n", capfile);
+		cap = &capture;
+	}
+	pthread_cleanup_push(net_capture_close, &capture);
 
 	// Drop all packets to date
 	unsigned char *p_frame;
-	while(p_frame=hashpipe_pktsock_recv_frame_nonblock(p_ps)) {
-		hashpipe_pktsock_release_frame(p_frame);
+	struct tpacket_block_desc *p_block = NULL;  //Ring block being consumed in block mode
+	struct tpacket3_hdr *p_hdr = NULL;          //Next frame to consume within the ring block
+	uint32_t block_pkts = 0;                    //Number of frames left within the ring block
+	uint32_t xsk_idx;                           //Rx ring index of the batch in XDP mode
+	if (p_sock->rxmode == NETRXMODE_BLOCK) {
+		while((p_block = HSD_pktsock_v3_recv_block_nonblock(p_ps3))) {
+			HSD_pktsock_v3_release_block(p_block);
+		}
+	} else if (p_sock->rxmode == NETRXMODE_XDP) {
+		while((block_pkts = HSD_xsk_peek(p_xsk, XSK_NFRAMES, &xsk_idx))) {
+			HSD_xsk_release(p_xsk, block_pkts);
+		}
+		//AF_XDP frames carry no kernel receive time
+		if (tsrc == NETTSRC_KERNEL) {
+			printf("Warning: NETTSRC KERNEL is not available in XDP mode. Using BATCH.\n");
+			tsrc = NETTSRC_BATCH;
+		}
+	} else if (p_sock->rxmode == NETRXMODE_UDP) {
+		while(HSD_udpsock_recv_batch(p_us, UDPSOCK_BATCH)) {}
+	} else {
+		while((p_frame = hashpipe_pktsock_recv_frame_nonblock(p_ps))) {
+			hashpipe_pktsock_release_frame(p_frame);
+		}
 	}
 
     #ifdef TEST_MODE
         FILE *fptr;
         fptr = fopen("./input_buffer.log", "w");
-        fprintf(fptr, "%s%15s%15s%15s%15s%15s%15s%15s\n",
-                "ACQMODE", "PKTNUM", "MODNUM", "QUABONUM", "PKTUTC", "PKTNSEC", "tv_sec", "tv_usec");
-        /*printf("%s%15s%15s%15s%15s%15s%15s%15s\n",
-                "ACQMODE", "PKTNUM", "MODNUM", "QUABONUM", "PKTUTC", "PKTNSEC", "tv_sec", "tv_usec");*/
+        fprintf(fptr, "%s%15s%15s%15s%15s%15s%22s\n",
+                "ACQMODE", "PKTNUM", "MODNUM", "QUABONUM", "PKTUTC", "PKTNSEC", "recvTime");
+        /*printf("%s%15s%15s%15s%15s%15s%22s\n",
+                "ACQMODE", "PKTNUM", "MODNUM", "QUABONUM", "PKTUTC", "PKTNSEC", "recvTime");*/
     #endif
 
     /* Main Loop */
@@ -243,75 +838,282 @@ static void *run(hashpipe_thread_args_t * args){
 
         blockHeader = &(db->block[block_idx].header);
         blockHeader->data_block_size = 0;
+        recv_start = monotonic_ns();
+        recv_waited = wait.spinning_ns + wait.sleeping_ns;
+        if (tsrc == NETTSRC_BATCH) batch_ns = realtime_ns();
+        flush_deadline = NETFLUSH_NONE;
 
-        // Loop through all of the packets in the buffer block.
-        for (int i = 0; i < IN_PKT_PER_BLOCK; i++){
-            //Check if the INTSIG is recognized
-            //printf("Started for loop: %i\n", i);
-            if(INTSIG) break;
+        if (p_sock->rxmode == NETRXMODE_BLOCK) {
+            // Fill the buffer block from retired ring blocks. A ring block that is
+            // not fully consumed is carried over to the next buffer block.
+            int i = 0;
+            while (i < pkts_per_block){
+                if(INTSIG) break;
 
-            //Recv all of the UDP packets from PKTSOCK
-            do {
-                p_frame = hashpipe_pktsock_recv_udp_frame_nonblock(p_ps, bindport);
-            } while (!p_frame && run_threads() && !INTSIG && !check_acqmode(p_frame));
-
-            //Check to see if the threads are still running. If not then terminate
-            if(!run_threads() || INTSIG) break;
-            //printf("Still Running\n");
-
-            //TODO
-            //Check Packet Number at the beginning and end to see if we lost any packets
-            npackets++;
-            pkt_data = (unsigned char *) PKT_UDP_DATA(p_frame);
-            get_header(pkt_data, i, blockHeader);
-
-            //Copy the packets in PKTSOCK to the input circular buffer
-            //Size is based on whether or not the mode is 16 bit or 8 bit
-            if (blockHeader->acqmode[i] < 4){
-                memcpy(db->block[block_idx].data_block+i*PKTDATASIZE, pkt_data+16, PKTDATASIZE*sizeof(unsigned char));
-            } else {
-                memcpy(db->block[block_idx].data_block+i*PKTDATASIZE, pkt_data+16, BIT8PKTDATASIZE*sizeof(unsigned char));
+                //Wait for the kernel to retire the next ring block
+                if (!p_block){
+                    p_block = HSD_pktsock_v3_recv_block_nonblock(p_ps3);
+                    if (!p_block){
+                        net_wait_begin(&wait);
+                        while (!p_block && run_threads() && !INTSIG && !net_flush_due(flush_deadline)){
+                            net_wait_idle(&wait, p_ps3->fd, flush_deadline);
+                            p_block = HSD_pktsock_v3_recv_block_nonblock(p_ps3);
+                        }
+                        net_wait_end(&wait);
+                    }
+
+                    //Check to see if the threads are still running. If not then terminate
+                    if(!run_threads() || INTSIG) break;
+
+                    //Hand the partially filled block downstream once the deadline passed
+                    if(!p_block) {
+                        nflushes++;
+                        break;
+                    }
+
+                    p_hdr = HSD_pktsock_v3_block_first(p_block);
+                    block_pkts = HSD_pktsock_v3_block_npkts(p_block);
+
+                    //The ring block is the batch
+                    if (tsrc == NETTSRC_BATCH) batch_ns = realtime_ns();
+                }
+
+                //Handle every frame in the ring block in one pass
+                for (; block_pkts > 0 && i < pkts_per_block; block_pkts--, p_hdr = PKT3_NEXT(p_hdr)){
+                    if (!PKT3_IS_UDP(p_hdr) || PKT3_UDP_DST(p_hdr) != bindport) continue;
+
+                    pkt_data = PKT3_UDP_DATA(p_hdr);
+                    if (!valid_acqmode(pkt_data[0])) continue;
+                    //The frames are packed back to back, so the bytes after a short datagram are the next frame
+                    if (PKT3_UDP_LEN(p_hdr) < (int)HSD_packet_size(pkt_data[0]) ||
+                        PKT3_UDP_CAPLEN(p_hdr) < (int)HSD_packet_size(pkt_data[0])){
+                        nrunts++;
+                        continue;
+                    }
+
+                    if (tsrc == NETTSRC_KERNEL){
+                        recv_ns = (uint64_t)p_hdr->tp_sec * 1000000000ULL + p_hdr->tp_nsec;
+                    } else if (tsrc == NETTSRC_BATCH){
+                        recv_ns = batch_ns;
+                    } else {
+                        recv_ns = realtime_ns();
+                    }
+
+                    store_packet(&(db->block[block_idx]), i, pkt_data, recv_ns, seq, cap);
+                    npackets++;
+                    if (i == 0 && flushus > 0) flush_deadline = monotonic_ns() + (uint64_t)flushus * 1000;
+                    i++;
+                }
+
+                //Give the ring block back to the kernel once all frames are consumed
+                if (block_pkts == 0){
+                    HSD_pktsock_v3_release_block(p_block);
+                    p_block = NULL;
+                }
+
+                pthread_testcancel();
             }
+        } else if (p_sock->rxmode == NETRXMODE_XDP) {
+            // Fill the buffer block from batches of the rx ring. A batch never holds
+            // more packets than the space left in the buffer block.
+            int i = 0;
+            while (i < pkts_per_block){
+                if(INTSIG) break;
+
+                block_pkts = HSD_xsk_peek(p_xsk, pkts_per_block - i, &xsk_idx);
+                if (!block_pkts){
+                    net_wait_begin(&wait);
+                    while (!block_pkts && run_threads() && !INTSIG && !net_flush_due(flush_deadline)){
+                        net_wait_idle(&wait, p_xsk->fd, flush_deadline);
+                        block_pkts = HSD_xsk_peek(p_xsk, pkts_per_block - i, &xsk_idx);
+                    }
+                    net_wait_end(&wait);
+                }
+
+                //Check to see if the threads are still running. If not then terminate
+                if(!run_threads() || INTSIG) break;
+
+                //Hand the partially filled block downstream once the deadline passed
+                if(!block_pkts) {
+                    nflushes++;
+                    break;
+                }
+
+                if (tsrc == NETTSRC_BATCH) batch_ns = realtime_ns();
 
-            //Time stamping the packets and passing it into the shared buffer
-            rc = gettimeofday(&nowTime, NULL);
-            if (rc == 0){
-                blockHeader->tv_sec[i] = nowTime.tv_sec;
-                blockHeader->tv_usec[i] = nowTime.tv_usec;
-            } else {
-                printf("gettimeofday() failed, errno = %d\n", errno);
-                blockHeader->tv_sec[i] = 0;
-                blockHeader->tv_usec[i] = 0;
+                //Handle every packet of the batch in one pass
+                for (uint32_t k = 0; k < block_pkts; k++){
+                    const struct xdp_desc *p_desc = HSD_xsk_rx_desc(p_xsk, xsk_idx + k);
+                    p_frame = HSD_xsk_frame(p_xsk, p_desc);
+                    if (!XSK_IS_UDP(p_frame) || XSK_UDP_DST(p_frame) != bindport) continue;
+
+                    pkt_data = XSK_UDP_DATA(p_frame);
+                    if (!valid_acqmode(pkt_data[0])) continue;
+                    if (p_desc->len < ETH_HLEN + PKT3_UDP_OFFSET + HSD_packet_size(pkt_data[0])){
+                        nrunts++;
+                        continue;
+                    }
+
+                    recv_ns = (tsrc == NETTSRC_BATCH) ? batch_ns : realtime_ns();
+                    store_packet(&(db->block[block_idx]), i, pkt_data, recv_ns, seq, cap);
+                    npackets++;
+                    if (i == 0 && flushus > 0) flush_deadline = monotonic_ns() + (uint64_t)flushus * 1000;
+                    i++;
+                }
+
+                //Give the frames of the batch back to the kernel
+                HSD_xsk_release(p_xsk, block_pkts);
+
+                pthread_testcancel();
+            }
+        } else if (p_sock->rxmode == NETRXMODE_UDP) {
+            // Fill the buffer block from recvmmsg() batches. A batch never holds
+            // more packets than the space left in the buffer block.
+            int i = 0;
+            while (i < pkts_per_block){
+                if(INTSIG) break;
+
+                block_pkts = HSD_udpsock_recv_batch(p_us, pkts_per_block - i);
+                if (!block_pkts){
+                    net_wait_begin(&wait);
+                    while (!block_pkts && run_threads() && !INTSIG && !net_flush_due(flush_deadline)){
+                        net_wait_idle(&wait, p_us->fd, flush_deadline);
+                        block_pkts = HSD_udpsock_recv_batch(p_us, pkts_per_block - i);
+                    }
+                    net_wait_end(&wait);
+                }
+
+                //Check to see if the threads are still running. If not then terminate
+                if(!run_threads() || INTSIG) break;
+
+                //Hand the partially filled block downstream once the deadline passed
+                if(!block_pkts) {
+                    nflushes++;
+                    break;
+                }
+
+                if (tsrc == NETTSRC_BATCH) batch_ns = realtime_ns();
+
+                //Handle every packet of the batch in one pass
+                for (uint32_t k = 0; k < block_pkts; k++){
+                    pkt_data = HSD_udpsock_data(p_us, k);
+                    if (!valid_acqmode(pkt_data[0])) continue;
+                    //The buffers are reused, so the bytes after a short datagram are from an older one
+                    if (HSD_udpsock_len(p_us, k) < HSD_packet_size(pkt_data[0])){
+                        nrunts++;
+                        continue;
+                    }
+
+                    if (tsrc == NETTSRC_KERNEL){
+                        recv_ns = HSD_udpsock_time_ns(p_us, k);
+                    } else if (tsrc == NETTSRC_BATCH){
+                        recv_ns = batch_ns;
+                    } else {
+                        recv_ns = realtime_ns();
+                    }
+
+                    store_packet(&(db->block[block_idx]), i, pkt_data, recv_ns, seq, cap);
+                    npackets++;
+                    if (i == 0 && flushus > 0) flush_deadline = monotonic_ns() + (uint64_t)flushus * 1000;
+                    i++;
+                }
+
+                pthread_testcancel();
             }
+        } else {
+            // Loop through all of the packets in the buffer block.
+            for (int i = 0; i < pkts_per_block;){
+                //Check if the INTSIG is recognized
+                //printf("Started for loop: %i\n", i);
+                if(INTSIG) break;
+
+                //Recv all of the UDP packets from PKTSOCK
+                p_frame = hashpipe_pktsock_recv_udp_frame_nonblock(p_ps, bindport);
+                if (!p_frame){
+                    net_wait_begin(&wait);
+                    do {
+                        if (net_flush_due(flush_deadline)) break;
+                        net_wait_idle(&wait, p_ps->fd, flush_deadline);
+                        p_frame = hashpipe_pktsock_recv_udp_frame_nonblock(p_ps, bindport);
+                    } while (!p_frame && run_threads() && !INTSIG && !check_acqmode(p_frame));
+                    net_wait_end(&wait);
+
+                    //Packets taken from the ring until the next wait form a batch
+                    if (tsrc == NETTSRC_BATCH) batch_ns = realtime_ns();
+                }
+
+                //Check to see if the threads are still running. If not then terminate
+                if(!run_threads() || INTSIG) break;
+                //printf("Still Running\n");
 
-            blockHeader->data_block_size++;
+                //Hand the partially filled block downstream once the deadline passed
+                if(!p_frame) {
+                    nflushes++;
+                    break;
+                }
 
-            //Release the hashpipe frame back to the kernel to gather data
-            hashpipe_pktsock_release_frame(p_frame);
+                //Packets the socket filter let through are checked again, e.g. with NETFILT=NONE
+                pkt_data = (unsigned char *) PKT_UDP_DATA(p_frame);
+                if (!valid_acqmode(pkt_data[0])){
+                    hashpipe_pktsock_release_frame(p_frame);
+                    continue;
+                }
 
-            pthread_testcancel();
+                npackets++;
+                if (tsrc == NETTSRC_KERNEL){
+                    recv_ns = (uint64_t)TPACKET_HDR(p_frame, tp_sec) * 1000000000ULL
+                            + (uint64_t)TPACKET_HDR(p_frame, tp_usec) * 1000;
+                } else if (tsrc == NETTSRC_BATCH){
+                    recv_ns = batch_ns;
+                } else {
+                    recv_ns = realtime_ns();
+                }
+                store_packet(&(db->block[block_idx]), i, pkt_data, recv_ns, seq, cap);
+                if (i == 0 && flushus > 0) flush_deadline = monotonic_ns() + (uint64_t)flushus * 1000;
+                i++;
+
+                //Release the hashpipe frame back to the kernel to gather data
+                hashpipe_pktsock_release_frame(p_frame);
+
+                pthread_testcancel();
+            }
         }
+        //Time spent on the block that was not spent waiting for packets
+        working_ns += (monotonic_ns() - recv_start) - (wait.spinning_ns + wait.sleeping_ns - recv_waited);
+
         //Send the signal of SIGINT to the blockHeader
         blockHeader->INTSIG = INTSIG;
 
         #ifdef TEST_MODE
             for (int i = 0; i < blockHeader->data_block_size; i++){
-                fprintf(fptr, "%7u%15u%15u%15u%15u%15u%15lu%15lu\n",
-                        blockHeader->acqmode[i], blockHeader->pktNum[i],
-                        blockHeader->modNum[i], blockHeader->quaNum[i],
-                        blockHeader->pktUTC[i], blockHeader->pktNSEC[i],
-                        blockHeader->tv_sec[i], blockHeader->tv_usec[i]);
-                /*printf("%7u%15u%15u%15u%15u%15u%15lu%15lu\n",
-                        blockHeader->acqmode[i], blockHeader->pktNum[i],
-                        blockHeader->modNum[i], blockHeader->quaNum[i],
-                        blockHeader->pktUTC[i], blockHeader->pktNSEC[i],
-                        blockHeader->tv_sec[i], blockHeader->tv_usec[i]);*/
+                HSD_pkt_desc_t* desc = &(blockHeader->pkt[i]);
+                fprintf(fptr, "%7u%15u%15u%15u%15u%15u%22lu\n",
+                        desc->acqmode, desc->pktNum,
+                        HSD_pkt_modnum(desc), HSD_pkt_quanum(desc),
+                        desc->pktUTC, desc->pktNSEC,
+                        desc->recvTime);
+                /*printf("%7u%15u%15u%15u%15u%15u%22lu\n",
+                        desc->acqmode, desc->pktNum,
+                        HSD_pkt_modnum(desc), HSD_pkt_quanum(desc),
+                        desc->pktUTC, desc->pktNSEC,
+                        desc->recvTime);*/
             }
         #endif
 
 
         // Get stats from packet socket
-		hashpipe_pktsock_stats(p_ps, &pktsock_pkts, &pktsock_drops);
+        if (p_sock->rxmode == NETRXMODE_BLOCK) {
+            HSD_pktsock_v3_stats(p_ps3, &pktsock_pkts, &pktsock_drops, &pktsock_freezes);
+        } else if (p_sock->rxmode == NETRXMODE_XDP) {
+            //There is no kernel packet counter, and an empty fill ring stalls the queue like a frozen ring
+            pktsock_pkts = npackets;
+            HSD_xsk_stats(p_xsk, &pktsock_drops, &pktsock_freezes);
+        } else if (p_sock->rxmode == NETRXMODE_UDP) {
+            pktsock_pkts = npackets;
+            pktsock_drops = p_us->drops;
+        } else {
+		    hashpipe_pktsock_stats(p_ps, &pktsock_pkts, &pktsock_drops);
+        }
 
         hashpipe_status_lock_safe(&st);
 		hputi8(st.buf, "NPACKETS", npackets);
@@ -319,6 +1121,26 @@ static void *run(hashpipe_thread_args_t * args){
 		//hputr8(st.buf,"LOSSRATE",pkt_loss_rate);		
 		hputu8(st.buf, "NETRECV",  pktsock_pkts);
 		hputu8(st.buf, "NETDROPS", pktsock_drops);
+		hputu8(st.buf, "NETFRZQ", pktsock_freezes);
+		hputu8(st.buf, "NETSPNMS", wait.spinning_ns / 1000000);
+		hputu8(st.buf, "NETSLPMS", wait.sleeping_ns / 1000000);
+		hputu8(st.buf, "NETWRKMS", working_ns / 1000000);
+		hputu8(st.buf, "NETNPOLL", wait.npolls);
+		hputu8(st.buf, "NETNFLSH", nflushes);
+		hputu8(st.buf, "NETRUNTS", nrunts);
+		if (cap) {
+			hputs(st.buf, "NETCAPST", cap->fp ? "capturing" : "failed");
+			hputu8(st.buf, "NETCAPPK", cap->npkts);
+		}
+		hputu8(st.buf, "NETLOST", seq->lost);
+		hputu8(st.buf, "NETDUPS", seq->dups);
+		hputu8(st.buf, "NETREORD", seq->reorders);
+		hputu8(st.buf, "NETRSTRT", seq->restarts);
+		hputi4(st.buf, "NETNQBO", seq->nquabos);
+		if (monotonic_ns() - seq_published > NETSEQ_PUBLISH_NS) {
+			net_seq_publish(seq, st.buf);
+			seq_published = monotonic_ns();
+		}
 		hashpipe_status_unlock_safe(&st);
 
 
@@ -343,7 +1165,9 @@ static void *run(hashpipe_thread_args_t * args){
 
     }
 
-    pthread_cleanup_pop(1); /* Closes push(hashpipe_pktsock_close) */
+    pthread_cleanup_pop(1); /* Closes push(net_capture_close) */
+    pthread_cleanup_pop(1); /* Closes push(free) of seq */
+    pthread_cleanup_pop(1); /* Closes push(net_socket_close) */
 	pthread_cleanup_pop(1); /* Closes push(free) */
 
     printf("Returned Net_thread\n");
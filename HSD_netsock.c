@@ -0,0 +1,803 @@
+/* HSD_netsock.c
+ *
+ * Socket backends used by the net thread to receive packets from the quabos.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include "hashpipe.h"
+#include "HSD_netsock.h"
+#include "HSD_topology.h"
+
+int HSD_pktsock_v3_open(HSD_pktsock_v3_t *p_ps, const char *ifname,
+                        unsigned int frame_size, unsigned int frames_per_block,
+                        unsigned int nblocks, unsigned int timeout_ms){
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    size_t ring_size;
+
+    p_ps->fd = -1;
+    p_ps->p_ring = NULL;
+    p_ps->next_block = 0;
+    p_ps->frame_size = frame_size;
+    p_ps->block_size = frame_size * frames_per_block;
+    p_ps->nblocks = nblocks;
+
+    unsigned int ifindex = if_nametoindex(ifname);
+    if (ifindex == 0){
+        hashpipe_error(__FUNCTION__, "unknown interface %s", ifname);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    p_ps->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if (p_ps->fd == -1){
+        hashpipe_error(__FUNCTION__, "socket");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    if (setsockopt(p_ps->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(PACKET_VERSION)");
+        HSD_pktsock_v3_close(p_ps);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = p_ps->block_size;
+    req.tp_frame_size = frame_size;
+    req.tp_block_nr = nblocks;
+    req.tp_frame_nr = frames_per_block * nblocks;
+    req.tp_retire_blk_tov = timeout_ms;
+    req.tp_sizeof_priv = 0;
+    req.tp_feature_req_word = 0;
+
+    if (setsockopt(p_ps->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(PACKET_RX_RING)");
+        HSD_pktsock_v3_close(p_ps);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    ring_size = (size_t)p_ps->block_size * nblocks;
+    p_ps->p_ring = (unsigned char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_LOCKED, p_ps->fd, 0);
+    if (p_ps->p_ring == MAP_FAILED){
+        p_ps->p_ring = NULL;
+        hashpipe_error(__FUNCTION__, "mmap");
+        HSD_pktsock_v3_close(p_ps);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex = ifindex;
+
+    if (bind(p_ps->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        hashpipe_error(__FUNCTION__, "bind");
+        HSD_pktsock_v3_close(p_ps);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    return HASHPIPE_OK;
+}
+
+void HSD_pktsock_v3_stats(HSD_pktsock_v3_t *p_ps, unsigned int *p_pkts, unsigned int *p_drops, unsigned int *p_freezes){
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    if (getsockopt(p_ps->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == -1){
+        return;
+    }
+    if (p_pkts) *p_pkts += stats.tp_packets;
+    if (p_drops) *p_drops += stats.tp_drops;
+    if (p_freezes) *p_freezes += stats.tp_freeze_q_cnt;
+}
+
+int HSD_pktsock_v3_close(HSD_pktsock_v3_t *p_ps){
+    if (p_ps->p_ring){
+        munmap(p_ps->p_ring, (size_t)p_ps->block_size * p_ps->nblocks);
+        p_ps->p_ring = NULL;
+    }
+    if (p_ps->fd != -1){
+        close(p_ps->fd);
+        p_ps->fd = -1;
+    }
+    return HASHPIPE_OK;
+}
+
+/**
+ * Read the module pairs from the config file.
+ * @param config_file The module pair config file
+ * @param modules Array that is filled with the module numbers
+ * @param pairs Array that is filled with the index of the pair of each module
+ * @param max_modules The size of the arrays
+ * @return The number of modules read or -1 if the file could not be opened
+ */
+static int read_module_pairs(const char *config_file, unsigned int *modules, unsigned int *pairs, int max_modules){
+    HSD_topology_t *topo = (HSD_topology_t *)malloc(sizeof(HSD_topology_t));
+    int nmodules;
+
+    if (topo == NULL || HSD_topology_load(topo, config_file) != HASHPIPE_OK){
+        free(topo);
+        return -1;
+    }
+    nmodules = topo->n_modules;
+    if (nmodules > max_modules){
+        nmodules = max_modules - (max_modules % 2);
+        printf("Warning: Only the first %i modules of the config file are used for fanout.\n", nmodules);
+    }
+    for (int i = 0; i < nmodules; i++){
+        modules[i] = topo->module_num[i];
+        pairs[i] = i / 2;
+    }
+    free(topo);
+    return nmodules;
+}
+
+/**
+ * Emit the instructions that load the module number of the quabo packet into A.
+ * The module number is bits 2-15 of the little endian boardloc at bytes 4-5 of
+ * the UDP payload.
+ * @param prog The program being built
+ * @param net_off The offset of the IP header from the start of the packet
+ * @return The number of instructions emitted
+ */
+static int bpf_load_modnum(struct sock_filter *prog, unsigned int net_off){
+    struct sock_filter load[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, net_off),               // X = IP header length
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, net_off + 8 + 4),        // A = payload[4]
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 2),
+        BPF_STMT(BPF_ST, 0),                                        // M[0] = payload[4] >> 2
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, net_off + 8 + 5),        // A = payload[5]
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 6),
+        BPF_STMT(BPF_LDX | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),                      // A = module number
+    };
+    memcpy(prog, load, sizeof(load));
+    return sizeof(load)/sizeof(load[0]);
+}
+
+int HSD_netsock_join_fanout(int fd, int group_id, const char *config_file){
+    unsigned int modules[FANOUT_MAX_MODULES];
+    unsigned int pairs[FANOUT_MAX_MODULES];
+    struct sock_filter prog[16 + 2*FANOUT_MAX_MODULES];
+    struct sock_fprog fprog;
+    int nmodules;
+    int n;
+
+    nmodules = read_module_pairs(config_file, modules, pairs, FANOUT_MAX_MODULES);
+    if (nmodules < 0){
+        hashpipe_error(__FUNCTION__, "unable to open config file %s", config_file);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    //The fanout program sees the packet from the IP header onwards and
+    //returns the index of the socket modulo the size of the group.
+    n = bpf_load_modnum(prog, 0);
+    for (int i = 0; i < nmodules; i++){
+        //Every module jumps over the remaining compares and the default return
+        //to the return of its pair index.
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, modules[i], (__u8)nmodules, 0);
+    }
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    for (int i = 0; i < nmodules; i++){
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, pairs[i]);
+    }
+
+    int fanout_arg = (group_id & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(PACKET_FANOUT)");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    fprog.len = n;
+    fprog.filter = prog;
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(PACKET_FANOUT_DATA)");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    printf("Joined fanout group %i steering %i modules by module pair\n", group_id, nmodules);
+    return HASHPIPE_OK;
+}
+
+int HSD_netsock_attach_filter(int fd, int port, const char *config_file){
+    unsigned int modules[FANOUT_MAX_MODULES];
+    unsigned int pairs[FANOUT_MAX_MODULES];
+    struct sock_filter prog[32 + FANOUT_MAX_MODULES];
+    struct sock_fprog fprog;
+    int nmodules = 0;
+    int n;
+
+    if (config_file){
+        nmodules = read_module_pairs(config_file, modules, pairs, FANOUT_MAX_MODULES);
+        if (nmodules < 0){
+            hashpipe_error(__FUNCTION__, "unable to open config file %s", config_file);
+            return HASHPIPE_ERR_SYS;
+        }
+    }
+
+    //The socket filter sees the packet from the ethernet header onwards. Every
+    //rejected packet jumps to the drop at instruction 13 and every accepted
+    //acqmode jumps to instruction 14.
+    struct sock_filter header[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 9),               // A = IP protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 11),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + 6),               // A = IP fragment offset
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 9, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETH_HLEN),                  // X = IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, ETH_HLEN + 2),               // A = UDP destination port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned int)port, 0, 6),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, ETH_HLEN + 8),               // A = acqmode
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 5, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 2, 4, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 3, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 7, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    memcpy(prog, header, sizeof(header));
+    n = sizeof(header)/sizeof(header[0]);
+
+    //Only the modules of the config file are accepted when an allowlist is given
+    if (nmodules > 0){
+        n += bpf_load_modnum(prog + n, ETH_HLEN);
+        for (int i = 0; i < nmodules; i++){
+            //Jump over the remaining compares and the drop to the accept
+            prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, modules[i], (__u8)(nmodules - i), 0);
+        }
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    }
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+    fprog.len = n;
+    fprog.filter = prog;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(SO_ATTACH_FILTER)");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    if (nmodules > 0){
+        printf("Attached socket filter for port %i accepting %i modules\n", port, nmodules);
+    } else {
+        printf("Attached socket filter for port %i\n", port);
+    }
+    return HASHPIPE_OK;
+}
+
+/**
+ * Issue a bpf() system call.
+ */
+static int sys_bpf(int cmd, union bpf_attr *attr){
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Build one eBPF instruction.
+ */
+static inline struct bpf_insn xdp_insn(__u8 code, __u8 dst, __u8 src, __s16 off, __s32 imm){
+    struct bpf_insn insn;
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    return insn;
+}
+
+/**
+ * Load the XDP program that redirects the UDP packets to the port into the
+ * AF_XDP socket of the receive queue found in the XSKMAP. Every other packet,
+ * and every packet of a queue without a socket, is passed to the network stack.
+ * @return The program fd or -1 on failure
+ */
+static int xsk_load_prog(int map_fd, int port){
+    //r1 = ctx, r2 = data, r3 = data_end. Every check jumps to the pass at insn 19.
+    struct bpf_insn prog[] = {
+        xdp_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0),
+        xdp_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0),
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN + PKT3_UDP_OFFSET + 1),
+        xdp_insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 14, 0),                  // Too short
+        xdp_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 12, 0),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 12, htons(ETH_P_IP)),             // Not IP
+        xdp_insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_4, BPF_REG_2, ETH_HLEN, 0),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 10, 0x45),                        // IP options
+        xdp_insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_4, BPF_REG_2, ETH_HLEN + 9, 0),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 8, IPPROTO_UDP),                  // Not UDP
+        xdp_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, ETH_HLEN + 22, 0),
+        xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 6, htons(port)),                  // Other port
+        xdp_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0),
+        xdp_insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        xdp_insn(0, 0, 0, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),                   // Default action
+        xdp_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    char license[] = "GPL";
+    char log[4096];
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (__u64)(unsigned long)prog;
+    attr.insn_cnt = sizeof(prog)/sizeof(prog[0]);
+    attr.license = (__u64)(unsigned long)license;
+    attr.log_buf = (__u64)(unsigned long)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    log[0] = 0;
+
+    int prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (prog_fd < 0 && log[0]){
+        printf("XDP program verifier log:\n%s\n", log);
+    }
+    return prog_fd;
+}
+
+/**
+ * Get a BPF object pinned in the BPF filesystem.
+ * @return The fd of the object or -1 if it is not pinned
+ */
+static int bpf_obj_get(const char *path){
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (__u64)(unsigned long)path;
+    return sys_bpf(BPF_OBJ_GET, &attr);
+}
+
+/**
+ * Pin a BPF object in the BPF filesystem.
+ * @return 0 on success and -1 with errno set otherwise
+ */
+static int bpf_obj_pin(int fd, const char *path){
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (__u64)(unsigned long)path;
+    attr.bpf_fd = fd;
+    return sys_bpf(BPF_OBJ_PIN, &attr);
+}
+
+/**
+ * Get the XSKMAP of the receive queues of the interface. The first instance creates
+ * and pins the map, the others reuse it. Without the BPF filesystem the map is
+ * private and only one instance can receive from the interface.
+ * @param p_pinned Set to nonzero when the map is pinned at the path
+ * @return The map fd or -1 on failure
+ */
+static int xsk_get_map(const char *path, int *p_pinned){
+    union bpf_attr attr;
+
+    *p_pinned = 1;
+    int map_fd = bpf_obj_get(path);
+    if (map_fd >= 0){
+        return map_fd;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(__u32);
+    attr.value_size = sizeof(__u32);
+    attr.max_entries = XSK_MAX_QUEUES;
+    map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (map_fd < 0 || bpf_obj_pin(map_fd, path) == 0){
+        return map_fd;
+    }
+    if (errno == EEXIST){
+        //Another instance pinned its map first
+        close(map_fd);
+        return bpf_obj_get(path);
+    }
+    printf("Warning: Unable to pin the XSKMAP at %s. Only one instance can receive from the interface.\n", path);
+    *p_pinned = 0;
+    return map_fd;
+}
+
+/**
+ * Get the link of the XDP program that redirects into the map of the socket. The
+ * first instance loads the program, attaches it to the interface and pins the
+ * link, so the program stays attached while the other instances are running.
+ * @return The link fd or -1 on failure
+ */
+static int xsk_get_link(HSD_xsk_t *p_xsk, const char *path, int pinned,
+                        unsigned int ifindex, int port, int zerocopy){
+    union bpf_attr attr;
+
+    for (int attempt = 0; attempt < XSK_LINK_RETRIES; attempt++){
+        if (pinned){
+            int link_fd = bpf_obj_get(path);
+            if (link_fd >= 0){
+                return link_fd;
+            }
+        }
+
+        if (p_xsk->prog_fd < 0){
+            p_xsk->prog_fd = xsk_load_prog(p_xsk->map_fd, port);
+            if (p_xsk->prog_fd < 0){
+                hashpipe_error(__FUNCTION__, "bpf(BPF_PROG_LOAD)");
+                return -1;
+            }
+        }
+
+        //Zero-copy needs the native driver hook while copy mode lets the kernel choose
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = p_xsk->prog_fd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = zerocopy ? XDP_FLAGS_DRV_MODE : 0;
+        int link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if (link_fd >= 0){
+            if (pinned && bpf_obj_pin(link_fd, path) != 0){
+                printf("Warning: Unable to pin the XDP link at %s. The other instances stop receiving when this one stops.\n", path);
+            }
+            return link_fd;
+        }
+
+        //The interface takes a single XDP link, wait for the instance that is attaching it
+        if (errno != EBUSY || !pinned){
+            break;
+        }
+        usleep(XSK_LINK_WAIT_US);
+    }
+    hashpipe_error(__FUNCTION__, "bpf(BPF_LINK_CREATE)");
+    return -1;
+}
+
+/**
+ * Map one of the rings of an AF_XDP socket.
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+static int xsk_map_ring(int fd, HSD_xsk_ring_t *ring, struct xdp_ring_offset *off,
+                        unsigned int size, size_t desc_size, off_t pgoff){
+    ring->map_size = off->desc + size * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED){
+        ring->map = NULL;
+        return HASHPIPE_ERR_SYS;
+    }
+    ring->producer = (uint32_t *)((unsigned char *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((unsigned char *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((unsigned char *)ring->map + off->flags);
+    ring->ring = (unsigned char *)ring->map + off->desc;
+    ring->size = size;
+    ring->mask = size - 1;
+    ring->cached_prod = *ring->producer;
+    ring->cached_cons = *ring->consumer;
+    return HASHPIPE_OK;
+}
+
+int HSD_xsk_open(HSD_xsk_t *p_xsk, const char *ifname, unsigned int queue_id, int port,
+                 unsigned int frame_size, unsigned int nframes, int zerocopy){
+    struct xdp_umem_reg umem_reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr;
+    union bpf_attr attr;
+    socklen_t optlen;
+
+    memset(p_xsk, 0, sizeof(*p_xsk));
+    p_xsk->fd = -1;
+    p_xsk->map_fd = -1;
+    p_xsk->prog_fd = -1;
+    p_xsk->link_fd = -1;
+    p_xsk->queue_id = queue_id;
+    p_xsk->frame_size = frame_size;
+    p_xsk->nframes = nframes;
+
+    unsigned int ifindex = if_nametoindex(ifname);
+    if (ifindex == 0){
+        hashpipe_error(__FUNCTION__, "unknown interface %s", ifname);
+        return HASHPIPE_ERR_SYS;
+    }
+    if (queue_id >= XSK_MAX_QUEUES){
+        hashpipe_error(__FUNCTION__, "queue %u is above the max of %i queues", queue_id, XSK_MAX_QUEUES);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    p_xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (p_xsk->fd == -1){
+        hashpipe_error(__FUNCTION__, "socket(AF_XDP)");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    //Register the umem that all of the frames are received into
+    p_xsk->p_umem = (unsigned char *)mmap(NULL, (size_t)frame_size * nframes, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p_xsk->p_umem == MAP_FAILED){
+        p_xsk->p_umem = NULL;
+        hashpipe_error(__FUNCTION__, "mmap(umem)");
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+    memset(&umem_reg, 0, sizeof(umem_reg));
+    umem_reg.addr = (__u64)(unsigned long)p_xsk->p_umem;
+    umem_reg.len = (__u64)frame_size * nframes;
+    umem_reg.chunk_size = frame_size;
+    umem_reg.headroom = 0;
+    if (setsockopt(p_xsk->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(XDP_UMEM_REG)");
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    //Every frame is either in the fill ring or the rx ring so both hold all of them.
+    //The completion ring is only needed for transmit but must exist to bind.
+    if (setsockopt(p_xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &nframes, sizeof(nframes)) == -1 ||
+        setsockopt(p_xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &nframes, sizeof(nframes)) == -1 ||
+        setsockopt(p_xsk->fd, SOL_XDP, XDP_RX_RING, &nframes, sizeof(nframes)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(XDP rings)");
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    optlen = sizeof(off);
+    if (getsockopt(p_xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1){
+        hashpipe_error(__FUNCTION__, "getsockopt(XDP_MMAP_OFFSETS)");
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+    if (xsk_map_ring(p_xsk->fd, &(p_xsk->rx), &off.rx, nframes, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != HASHPIPE_OK ||
+        xsk_map_ring(p_xsk->fd, &(p_xsk->fill), &off.fr, nframes, sizeof(__u64), XDP_UMEM_PGOFF_FILL_RING) != HASHPIPE_OK ||
+        xsk_map_ring(p_xsk->fd, &(p_xsk->comp), &off.cr, nframes, sizeof(__u64), XDP_UMEM_PGOFF_COMPLETION_RING) != HASHPIPE_OK){
+        hashpipe_error(__FUNCTION__, "mmap(XDP rings)");
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    //Hand every frame to the kernel before binding
+    __u64 *fill_addrs = (__u64 *)p_xsk->fill.ring;
+    for (unsigned int i = 0; i < nframes; i++){
+        fill_addrs[(p_xsk->fill.cached_prod + i) & p_xsk->fill.mask] = (__u64)i * frame_size;
+    }
+    p_xsk->fill.cached_prod += nframes;
+    __atomic_store_n(p_xsk->fill.producer, p_xsk->fill.cached_prod, __ATOMIC_RELEASE);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = queue_id;
+    addr.sxdp_flags = (zerocopy ? XDP_ZEROCOPY : XDP_COPY) | XDP_USE_NEED_WAKEUP;
+    if (bind(p_xsk->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        hashpipe_error(__FUNCTION__, "bind(AF_XDP) to %s queue %u", ifname, queue_id);
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    //Map of the receive queues to the AF_XDP sockets, shared by the instances on the interface
+    char map_path[STRBUFFSIZE];
+    char link_path[STRBUFFSIZE];
+    int pinned;
+    snprintf(map_path, sizeof(map_path), XSK_PIN_FORMAT, ifname, port, "map");
+    snprintf(link_path, sizeof(link_path), XSK_PIN_FORMAT, ifname, port, "link");
+    p_xsk->map_fd = xsk_get_map(map_path, &pinned);
+    if (p_xsk->map_fd < 0){
+        hashpipe_error(__FUNCTION__, "bpf(BPF_MAP_CREATE)");
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    __u32 key = queue_id;
+    __u32 value = p_xsk->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = p_xsk->map_fd;
+    attr.key = (__u64)(unsigned long)&key;
+    attr.value = (__u64)(unsigned long)&value;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0){
+        hashpipe_error(__FUNCTION__, "bpf(BPF_MAP_UPDATE_ELEM)");
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    //The socket leaves the map when it is closed, the program stays attached for the other queues
+    p_xsk->link_fd = xsk_get_link(p_xsk, link_path, pinned, ifindex, port, zerocopy);
+    if (p_xsk->link_fd < 0){
+        hashpipe_error(__FUNCTION__, "unable to attach the XDP program to %s", ifname);
+        HSD_xsk_close(p_xsk);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    printf("AF_XDP socket on %s queue %u in %s mode\n", ifname, queue_id, zerocopy ? "zero-copy" : "copy");
+    return HASHPIPE_OK;
+}
+
+void HSD_xsk_release(HSD_xsk_t *p_xsk, uint32_t n){
+    HSD_xsk_ring_t *rx = &(p_xsk->rx);
+    HSD_xsk_ring_t *fill = &(p_xsk->fill);
+    __u64 *fill_addrs = (__u64 *)fill->ring;
+
+    if (n == 0) return;
+
+    //The fill ring holds every frame so there is always room for the released ones
+    for (uint32_t i = 0; i < n; i++){
+        const struct xdp_desc *p_desc = HSD_xsk_rx_desc(p_xsk, rx->cached_cons + i);
+        fill_addrs[(fill->cached_prod + i) & fill->mask] = p_desc->addr - (p_desc->addr % p_xsk->frame_size);
+    }
+    rx->cached_cons += n;
+    fill->cached_prod += n;
+    __atomic_store_n(rx->consumer, rx->cached_cons, __ATOMIC_RELEASE);
+    __atomic_store_n(fill->producer, fill->cached_prod, __ATOMIC_RELEASE);
+
+    //The driver stops receiving once the fill ring ran empty until it is woken up
+    if (__atomic_load_n(fill->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP){
+        recvfrom(p_xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+void HSD_xsk_stats(HSD_xsk_t *p_xsk, unsigned int *p_drops, unsigned int *p_fill_empty){
+    struct xdp_statistics stats;
+    socklen_t len = sizeof(stats);
+
+    if (getsockopt(p_xsk->fd, SOL_XDP, XDP_STATISTICS, &stats, &len) == -1){
+        return;
+    }
+    if (p_drops) *p_drops = stats.rx_dropped + stats.rx_ring_full;
+    if (p_fill_empty) *p_fill_empty = stats.rx_fill_ring_empty_descs;
+}
+
+int HSD_xsk_close(HSD_xsk_t *p_xsk){
+    if (p_xsk->link_fd >= 0){
+        close(p_xsk->link_fd);
+        p_xsk->link_fd = -1;
+    }
+    if (p_xsk->prog_fd >= 0){
+        close(p_xsk->prog_fd);
+        p_xsk->prog_fd = -1;
+    }
+    if (p_xsk->map_fd >= 0){
+        close(p_xsk->map_fd);
+        p_xsk->map_fd = -1;
+    }
+    HSD_xsk_ring_t *rings[] = {&(p_xsk->rx), &(p_xsk->fill), &(p_xsk->comp)};
+    for (int i = 0; i < 3; i++){
+        if (rings[i]->map){
+            munmap(rings[i]->map, rings[i]->map_size);
+            rings[i]->map = NULL;
+        }
+    }
+    if (p_xsk->fd != -1){
+        close(p_xsk->fd);
+        p_xsk->fd = -1;
+    }
+    if (p_xsk->p_umem){
+        munmap(p_xsk->p_umem, (size_t)p_xsk->frame_size * p_xsk->nframes);
+        p_xsk->p_umem = NULL;
+    }
+    return HASHPIPE_OK;
+}
+
+//Control buffer of every message of a UDP socket batch. It holds the receive
+//time and the drop counter.
+#define UDPSOCK_CTRL_SIZE   (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+int HSD_udpsock_open(HSD_udpsock_t *p_us, const char *host, int port, int rcvbuf, unsigned int batch){
+    struct sockaddr_in addr;
+    int on = 1;
+
+    memset(p_us, 0, sizeof(*p_us));
+    p_us->fd = -1;
+    p_us->batch = batch;
+
+    p_us->p_bufs = (unsigned char *)malloc((size_t)batch * UDPSOCK_BUF_SIZE);
+    p_us->msgs = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+    p_us->iovs = (struct iovec *)calloc(batch, sizeof(struct iovec));
+    p_us->p_ctrl = (unsigned char *)calloc(batch, UDPSOCK_CTRL_SIZE);
+    if (!p_us->p_bufs || !p_us->msgs || !p_us->iovs || !p_us->p_ctrl){
+        hashpipe_error(__FUNCTION__, "malloc");
+        HSD_udpsock_close(p_us);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    p_us->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (p_us->fd == -1){
+        hashpipe_error(__FUNCTION__, "socket");
+        HSD_udpsock_close(p_us);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    //Forcing the size past rmem_max needs CAP_NET_ADMIN, otherwise the kernel caps it
+    if (rcvbuf > 0){
+        if (setsockopt(p_us->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1 &&
+            setsockopt(p_us->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1){
+            hashpipe_error(__FUNCTION__, "setsockopt(SO_RCVBUF)");
+            HSD_udpsock_close(p_us);
+            return HASHPIPE_ERR_SYS;
+        }
+    }
+    if (setsockopt(p_us->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1 ||
+        setsockopt(p_us->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1){
+        hashpipe_error(__FUNCTION__, "setsockopt(SO_TIMESTAMPNS)");
+        HSD_udpsock_close(p_us);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1){
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    if (bind(p_us->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        hashpipe_error(__FUNCTION__, "bind to port %i", port);
+        HSD_udpsock_close(p_us);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    for (unsigned int i = 0; i < batch; i++){
+        p_us->iovs[i].iov_base = HSD_udpsock_data(p_us, i);
+        p_us->iovs[i].iov_len = UDPSOCK_BUF_SIZE;
+        p_us->msgs[i].msg_hdr.msg_iov = &(p_us->iovs[i]);
+        p_us->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return HASHPIPE_OK;
+}
+
+unsigned int HSD_udpsock_recv_batch(HSD_udpsock_t *p_us, unsigned int max){
+    if (max > p_us->batch) max = p_us->batch;
+
+    //The kernel overwrites the control length of every message
+    for (unsigned int i = 0; i < max; i++){
+        p_us->msgs[i].msg_hdr.msg_control = p_us->p_ctrl + (size_t)i * UDPSOCK_CTRL_SIZE;
+        p_us->msgs[i].msg_hdr.msg_controllen = UDPSOCK_CTRL_SIZE;
+    }
+
+    int n = recvmmsg(p_us->fd, p_us->msgs, max, MSG_DONTWAIT, NULL);
+    if (n <= 0) return 0;
+
+    //The drop counter is attached to every message, so the last one is current
+    struct msghdr *p_hdr = &(p_us->msgs[n-1].msg_hdr);
+    for (struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(p_hdr); p_cmsg; p_cmsg = CMSG_NXTHDR(p_hdr, p_cmsg)){
+        if (p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SO_RXQ_OVFL){
+            memcpy(&(p_us->drops), CMSG_DATA(p_cmsg), sizeof(p_us->drops));
+        }
+    }
+    return n;
+}
+
+uint64_t HSD_udpsock_time_ns(HSD_udpsock_t *p_us, unsigned int i){
+    struct msghdr *p_hdr = &(p_us->msgs[i].msg_hdr);
+    struct timespec ts;
+    for (struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(p_hdr); p_cmsg; p_cmsg = CMSG_NXTHDR(p_hdr, p_cmsg)){
+        if (p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_TIMESTAMPNS){
+            memcpy(&ts, CMSG_DATA(p_cmsg), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+int HSD_udpsock_rcvbuf(HSD_udpsock_t *p_us){
+    int rcvbuf = 0;
+    socklen_t len = sizeof(rcvbuf);
+    getsockopt(p_us->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    return rcvbuf;
+}
+
+int HSD_udpsock_close(HSD_udpsock_t *p_us){
+    if (p_us->fd != -1){
+        close(p_us->fd);
+        p_us->fd = -1;
+    }
+    free(p_us->p_bufs);
+    free(p_us->msgs);
+    free(p_us->iovs);
+    free(p_us->p_ctrl);
+    p_us->p_bufs = NULL;
+    p_us->msgs = NULL;
+    p_us->iovs = NULL;
+    p_us->p_ctrl = NULL;
+    return HASHPIPE_OK;
+}
@@ -0,0 +1,335 @@
+/* HSD_netsock.h
+ *
+ * Socket backends used by the net thread to receive packets from the quabos.
+ * The default backend is the hashpipe PACKET_RX_RING socket which hands out
+ * one frame at a time. The TPACKET_V3 socket defined here hands out whole
+ * retired ring blocks so that every frame in a block is processed in a
+ * single pass before the block is returned to the kernel. The AF_XDP socket
+ * receives the packets of one queue of the interface before the kernel
+ * network stack, in copy or zero-copy mode. The UDP socket receives batches
+ * with recvmmsg() and needs neither privileges nor a real interface.
+ */
+
+#ifndef _HSD_NETSOCK_H
+#define _HSD_NETSOCK_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include <linux/if_ether.h>
+#include "hashpipe.h"
+
+//Default ring block retire timeout in ms. A partially filled block is handed to
+//userspace once this expires so that low packet rates are not held in the ring.
+#define PKTSOCK_V3_BLOCK_TIMEOUT_MS     (8)
+
+//Offset of the UDP payload from the start of the IP header (no IP options)
+#define PKT3_UDP_OFFSET                 (28)
+
+//Accessors for the frames inside a TPACKET_V3 ring block
+#define PKT3_NET(h)         ((unsigned char *)(h) + (h)->tp_net)
+#define PKT3_UDP_DATA(h)    (PKT3_NET(h) + PKT3_UDP_OFFSET)
+#define PKT3_IS_UDP(h)      (PKT3_NET(h)[9] == IPPROTO_UDP)
+#define PKT3_UDP_DST(h)     ((uint16_t)((PKT3_NET(h)[22] << 8) | PKT3_NET(h)[23]))
+#define PKT3_UDP_LEN(h)     ((int)((PKT3_NET(h)[24] << 8) | PKT3_NET(h)[25]) - 8)   //Payload length of the UDP header
+#define PKT3_UDP_CAPLEN(h)  ((int)(h)->tp_snaplen - ((int)(h)->tp_net - (int)(h)->tp_mac) - PKT3_UDP_OFFSET)  //Payload bytes in the frame
+#define PKT3_NEXT(h)        ((struct tpacket3_hdr *)((unsigned char *)(h) + (h)->tp_next_offset))
+
+//Max number of modules that can be steered by the fanout program
+#define FANOUT_MAX_MODULES              (255)
+
+/**
+ * TPACKET_V3 packet socket with a memory mapped receive ring.
+ * The ring is made of nblocks blocks of block_size bytes, and the kernel
+ * retires a block to userspace once it is full or the retire timeout expires.
+ */
+typedef struct HSD_pktsock_v3 {
+    int fd;
+    unsigned int frame_size;
+    unsigned int block_size;
+    unsigned int nblocks;
+    unsigned char *p_ring;
+    unsigned int next_block;
+} HSD_pktsock_v3_t;
+
+/**
+ * Open a TPACKET_V3 socket on the interface and map its receive ring.
+ * @param p_ps The socket object to be initialized
+ * @param ifname The name of the interface to bind to
+ * @param frame_size The nominal frame size of the ring
+ * @param frames_per_block The number of nominal frames per ring block
+ * @param nblocks The number of blocks in the ring
+ * @param timeout_ms The block retire timeout in ms
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_pktsock_v3_open(HSD_pktsock_v3_t *p_ps, const char *ifname,
+                        unsigned int frame_size, unsigned int frames_per_block,
+                        unsigned int nblocks, unsigned int timeout_ms);
+
+/**
+ * Get the next retired ring block if the kernel has handed one to userspace.
+ * @return The block descriptor or NULL if no block is ready
+ */
+static inline struct tpacket_block_desc *HSD_pktsock_v3_recv_block_nonblock(HSD_pktsock_v3_t *p_ps){
+    struct tpacket_block_desc *p_block = (struct tpacket_block_desc *)
+        (p_ps->p_ring + (size_t)p_ps->next_block * p_ps->block_size);
+    if (!(__atomic_load_n(&p_block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)){
+        return NULL;
+    }
+    p_ps->next_block = (p_ps->next_block + 1) % p_ps->nblocks;
+    return p_block;
+}
+
+/**
+ * Return a ring block to the kernel once all of its frames have been consumed.
+ */
+static inline void HSD_pktsock_v3_release_block(struct tpacket_block_desc *p_block){
+    __atomic_store_n(&p_block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+/**
+ * Number of frames contained in a retired ring block.
+ */
+static inline uint32_t HSD_pktsock_v3_block_npkts(struct tpacket_block_desc *p_block){
+    return p_block->hdr.bh1.num_pkts;
+}
+
+/**
+ * First frame contained in a retired ring block.
+ */
+static inline struct tpacket3_hdr *HSD_pktsock_v3_block_first(struct tpacket_block_desc *p_block){
+    return (struct tpacket3_hdr *)((unsigned char *)p_block + p_block->hdr.bh1.offset_to_first_pkt);
+}
+
+/**
+ * Accumulate the kernel packet and drop counters of the socket.
+ * The kernel resets its counters on every read.
+ */
+void HSD_pktsock_v3_stats(HSD_pktsock_v3_t *p_ps, unsigned int *p_pkts, unsigned int *p_drops, unsigned int *p_freezes);
+
+/**
+ * Unmap the ring and close the socket.
+ */
+int HSD_pktsock_v3_close(HSD_pktsock_v3_t *p_ps);
+
+/**
+ * Join the PACKET_FANOUT group of a bound packet socket so that the packets
+ * of the interface are spread over all of the net threads in the group.
+ * A classic BPF program steers every quabo of a module pair in the config
+ * file to the same socket, and modules not in the config file are kept
+ * together by module number.
+ * @param fd The bound packet socket
+ * @param group_id The fanout group id shared by all of the net threads
+ * @param config_file The module pair config file
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_netsock_join_fanout(int fd, int group_id, const char *config_file);
+
+/**
+ * Attach a classic BPF socket filter so that the kernel only places UDP packets
+ * to the port with a recognized acqmode (1,2,3,6,7) in the receive ring.
+ * Housekeeping, broadcast and other traffic is dropped before it takes a ring slot.
+ * @param fd The packet socket
+ * @param port The UDP destination port of the science packets
+ * @param config_file The module pair config file used as a module allowlist or NULL for all modules
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_netsock_attach_filter(int fd, int port, const char *config_file);
+
+/**
+ * Single producer/single consumer ring shared with the kernel by an AF_XDP socket.
+ * The cached indices avoid touching the shared producer and consumer on every packet.
+ */
+typedef struct HSD_xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *ring;
+    uint32_t *flags;
+    uint32_t mask;
+    uint32_t size;
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+    void *map;
+    size_t map_size;
+} HSD_xsk_ring_t;
+
+//Default geometry of the AF_XDP umem. The frame size must be a power of two
+//between 2048 bytes and the page size.
+#define XSK_FRAME_SIZE                  (2048)
+#define XSK_NFRAMES                     (4096)
+
+//Max number of queues that can be redirected to AF_XDP sockets
+#define XSK_MAX_QUEUES                  (64)
+
+//The XSKMAP and the XDP link of an interface and port are pinned in the BPF filesystem so the
+//instances that receive the other queues of the interface share them. Removing both pins detaches
+//the program once no instance is running.
+#define XSK_PIN_FORMAT                  "/sys/fs/bpf/hsd_xsk_%s_%i_%s"
+#define XSK_LINK_RETRIES                (50)        //Tries to find the link of an instance that is attaching it
+#define XSK_LINK_WAIT_US                (20000)
+
+//Accessors for the ethernet frames received by an AF_XDP socket
+#define XSK_NET(f)          ((unsigned char *)(f) + ETH_HLEN)
+#define XSK_UDP_DATA(f)     (XSK_NET(f) + PKT3_UDP_OFFSET)
+#define XSK_IS_UDP(f)       (XSK_NET(f)[9] == IPPROTO_UDP)
+#define XSK_UDP_DST(f)      ((uint16_t)((XSK_NET(f)[22] << 8) | XSK_NET(f)[23]))
+
+/**
+ * AF_XDP socket bound to one queue of the interface. An XDP program redirects
+ * the UDP packets to the bound port of that queue into the socket and passes
+ * all other traffic to the kernel network stack. The program and its XSKMAP
+ * are shared by all instances that receive from the interface, each instance
+ * only adds the socket of its own queue to the map.
+ */
+typedef struct HSD_xsk {
+    int fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    unsigned int queue_id;
+    unsigned int frame_size;
+    unsigned int nframes;
+    unsigned char *p_umem;
+    HSD_xsk_ring_t rx;
+    HSD_xsk_ring_t fill;
+    HSD_xsk_ring_t comp;
+} HSD_xsk_t;
+
+/**
+ * Open an AF_XDP socket on the queue of the interface and add it to the XSKMAP
+ * of the XDP program that redirects the packets to the port. The first instance
+ * on the interface attaches the program, see XSK_PIN_FORMAT.
+ * @param p_xsk The socket object to be initialized
+ * @param ifname The name of the interface to bind to
+ * @param queue_id The receive queue of the interface to bind to
+ * @param port The UDP destination port of the packets to be redirected
+ * @param frame_size The size of the umem frames
+ * @param nframes The number of umem frames, which is also the size of the rings
+ * @param zerocopy Nonzero for zero-copy mode with a native XDP program and zero for copy mode
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_xsk_open(HSD_xsk_t *p_xsk, const char *ifname, unsigned int queue_id, int port,
+                 unsigned int frame_size, unsigned int nframes, int zerocopy);
+
+/**
+ * Get the number of received packets that are ready in the rx ring.
+ * @param p_xsk The socket
+ * @param max The max number of packets to take
+ * @param p_idx Set to the ring index of the first packet
+ * @return The number of packets taken, which must be given back with HSD_xsk_release
+ */
+static inline uint32_t HSD_xsk_peek(HSD_xsk_t *p_xsk, uint32_t max, uint32_t *p_idx){
+    HSD_xsk_ring_t *rx = &(p_xsk->rx);
+    uint32_t avail = rx->cached_prod - rx->cached_cons;
+    if (avail == 0){
+        rx->cached_prod = __atomic_load_n(rx->producer, __ATOMIC_ACQUIRE);
+        avail = rx->cached_prod - rx->cached_cons;
+    }
+    if (avail > max) avail = max;
+    *p_idx = rx->cached_cons;
+    return avail;
+}
+
+/**
+ * Descriptor of the received packet at the ring index.
+ */
+static inline const struct xdp_desc *HSD_xsk_rx_desc(HSD_xsk_t *p_xsk, uint32_t idx){
+    return &((const struct xdp_desc *)p_xsk->rx.ring)[idx & p_xsk->rx.mask];
+}
+
+/**
+ * Ethernet frame of a received packet in the umem.
+ */
+static inline unsigned char *HSD_xsk_frame(HSD_xsk_t *p_xsk, const struct xdp_desc *p_desc){
+    return p_xsk->p_umem + p_desc->addr;
+}
+
+/**
+ * Give the packets taken with HSD_xsk_peek back to the fill ring so that the
+ * kernel can receive into their frames again.
+ */
+void HSD_xsk_release(HSD_xsk_t *p_xsk, uint32_t n);
+
+/**
+ * Read the total number of packets dropped by the kernel because the rx ring
+ * was full and the number of times the fill ring was found empty. Unlike the
+ * packet socket counters these are not reset on read.
+ */
+void HSD_xsk_stats(HSD_xsk_t *p_xsk, unsigned int *p_drops, unsigned int *p_fill_empty);
+
+/**
+ * Detach the XDP program, unmap the rings and the umem and close the socket.
+ */
+int HSD_xsk_close(HSD_xsk_t *p_xsk);
+
+//Default geometry of the UDP socket batches. The buffer size must hold the
+//largest quabo packet.
+#define UDPSOCK_BUF_SIZE                (2048)
+#define UDPSOCK_BATCH                   (64)
+
+/**
+ * UDP socket that receives up to batch packets per recvmmsg() call into its
+ * own buffers, each with the kernel receive time from SO_TIMESTAMPNS.
+ */
+typedef struct HSD_udpsock {
+    int fd;
+    unsigned int batch;
+    unsigned char *p_bufs;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    unsigned char *p_ctrl;
+    uint32_t drops;         //Packets dropped by the socket from SO_RXQ_OVFL
+} HSD_udpsock_t;
+
+/**
+ * Open a UDP socket bound to the port.
+ * @param p_us The socket object to be initialized
+ * @param host The IPv4 address to bind to. Any other string binds to every address.
+ * @param port The UDP port to bind to
+ * @param rcvbuf The requested socket receive buffer size in bytes or 0 for the system default
+ * @param batch The max number of packets received per call
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS otherwise
+ */
+int HSD_udpsock_open(HSD_udpsock_t *p_us, const char *host, int port, int rcvbuf, unsigned int batch);
+
+/**
+ * Receive the packets that are queued on the socket without waiting.
+ * @param p_us The socket
+ * @param max The max number of packets to receive, capped by the batch size
+ * @return The number of packets received into the buffers of the socket
+ */
+unsigned int HSD_udpsock_recv_batch(HSD_udpsock_t *p_us, unsigned int max);
+
+/**
+ * Payload of the i-th packet of the last batch.
+ */
+static inline unsigned char *HSD_udpsock_data(HSD_udpsock_t *p_us, unsigned int i){
+    return p_us->p_bufs + (size_t)i * UDPSOCK_BUF_SIZE;
+}
+
+/**
+ * Payload length of the i-th packet of the last batch.
+ */
+static inline unsigned int HSD_udpsock_len(HSD_udpsock_t *p_us, unsigned int i){
+    return p_us->msgs[i].msg_len;
+}
+
+/**
+ * Kernel receive time of the i-th packet of the last batch in ns since the
+ * epoch, or 0 if the kernel did not attach one.
+ */
+uint64_t HSD_udpsock_time_ns(HSD_udpsock_t *p_us, unsigned int i);
+
+/**
+ * Read the actual socket receive buffer size, which may be smaller than requested.
+ */
+int HSD_udpsock_rcvbuf(HSD_udpsock_t *p_us);
+
+/**
+ * Free the buffers and close the socket.
+ */
+int HSD_udpsock_close(HSD_udpsock_t *p_us);
+
+#endif
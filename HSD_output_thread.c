@@ -14,6 +14,8 @@
 #include <sys/stat.h>
 #include "hashpipe.h"
 #include "HSD_databuf.h"
+#include "HSD_topology.h"
+#include "HSD_pixstats.h"
 #include "hiredis/hiredis.h"
 #include "hdf5.h"
 #include "hdf5_hl.h"
@@ -26,6 +28,7 @@
 
 //Defining the Formats that will be used within the HDF5 data file
 #define H5FILE_NAME_FORMAT "PANOSETI_%s_%04i_%02i_%02i_%02i-%02i-%02i.h5"
+#define H5FILE_INSTANCE_NAME_FORMAT "PANOSETI_%s_%04i_%02i_%02i_%02i-%02i-%02i_I%02i.h5"
 #define TIME_FORMAT "%04i-%02i-%02iT%02i:%02i:%02i UTC"
 #define FRAME_FORMAT "Frame%05i"
 #define IMGDATA_FORMAT "DATA%09i"
@@ -33,6 +36,15 @@
 #define PHDATA_FORMAT "PH_Module%05i_Quabo%01i_UTC%09i_NANOSEC%09i_PKTNUM%05i"
 #define QUABO_FORMAT "QUABO%05i_%01i"
 
+#define PIXSTATS_GROUP "/PixelStats"
+#define PIXSTATS_CLOSE_TIMEOUT_MS 5000 //Time the compute thread has to close the pixel statistics of a file
+#define TRANSIENT_EVENT_FORMAT "ModulePair_%05u_%05u_bit%02i_Event%06u"
+#define TRANSIENT_MAX_FRAMES 64     //Max frames of a short transient event
+
+#define PHCOINC_TABLENAME "Coincidence"
+#define PHCOINC_TABLETITLE "PH Coincidence Events of the Module Pairs"
+#define PHCOINCFIELDS 8
+
 #define HK_TABLENAME_FORAMT "HK_Module%05i_Quabo%01i"
 #define HK_TABLETITLE_FORMAT "HouseKeeping Data for Module%05i_Quabo%01i"
 
@@ -43,6 +55,9 @@
 
 static char saveLocation[STRBUFFSIZE];
 
+//Hashpipe instance added to the file name when instances share the packets in a fanout group
+static int fileInstance = -1;
+
 //Defining the static values for the storage values for HDF5 file
 static hsize_t storageDim[RANK] = {PKTPERDATASET, PKTPERPAIR, SCIDATASIZE};
 static hid_t storageSpace = H5Screate_simple(RANK, storageDim, NULL);
@@ -66,6 +81,10 @@ static long long fileSize = 0;
 
 static long long maxFileSize = 0; //IN UNITS OF APPROX 2 BYTES OR 16 bits
 
+static int triggerPixels = 0; //TRIGPIX of the transient trigger, 0 when it is disabled
+
+static int phCoincWindow = 0; //PHCWIN of the PH coincidence events, 0 when they are not grouped
+
 /**
  * The fileID structure for the current HDF5 opened.
  */
@@ -339,14 +358,14 @@ void write_Dataset(modulePairFile_t *modPair, HSD_output_block_t *block, int i)
     H5Sselect_hyperslab(dataMSpaceModPair, H5S_SELECT_SET, mOffsetModPair, NULL, mCountModPair, NULL);
 
     if (mode == 16) {
-        status = H5Dwrite(modPair->bit16Dataset, storageTypebit16, dataMSpace, dataSpace, H5P_DEFAULT, block->stream_block + (i * MODPAIRDATASIZE));
+        status = H5Dwrite(modPair->bit16Dataset, storageTypebit16, dataMSpace, dataSpace, H5P_DEFAULT, HSD_output_stream_record(block, i));
         status = H5Dwrite(modPair->bit16pktNum, H5T_STD_U16LE, dataMSpaceMeta, dataSpaceMeta, H5P_DEFAULT, block->header.pktNum + (i * PKTPERPAIR));
         status = H5Dwrite(modPair->bit16pktNSEC, H5T_STD_U32LE, dataMSpaceMeta, dataSpaceMeta, H5P_DEFAULT, block->header.pktNSEC + (i * PKTPERPAIR));
         status = H5Dwrite(modPair->bit16tv_sec, H5T_NATIVE_LONG, dataMSpaceMeta, dataSpaceMeta, H5P_DEFAULT, block->header.tv_sec + (i * PKTPERPAIR));
         status = H5Dwrite(modPair->bit16tv_usec, H5T_NATIVE_LONG, dataMSpaceMeta, dataSpaceMeta, H5P_DEFAULT, block->header.tv_usec + (i * PKTPERPAIR));
         status = H5Dwrite(modPair->bit16status, H5T_STD_U8LE, dataMSpaceModPair, dataSpaceModPair, H5P_DEFAULT, block->header.status + i);
     } else if (mode == 8) {
-        status = H5Dwrite(modPair->bit8Dataset, storageTypebit8, dataMSpace, dataSpace, H5P_DEFAULT, block->stream_block + (i * MODPAIRDATASIZE));
+        status = H5Dwrite(modPair->bit8Dataset, storageTypebit8, dataMSpace, dataSpace, H5P_DEFAULT, HSD_output_stream_record(block, i));
         status = H5Dwrite(modPair->bit8pktNum, H5T_STD_U16LE, dataMSpaceMeta, dataSpaceMeta, H5P_DEFAULT, block->header.pktNum + (i * PKTPERPAIR));
         status = H5Dwrite(modPair->bit8pktNSEC, H5T_STD_U32LE, dataMSpaceMeta, dataSpaceMeta, H5P_DEFAULT, block->header.pktNSEC + (i * PKTPERPAIR));
         status = H5Dwrite(modPair->bit8tv_sec, H5T_NATIVE_LONG, dataMSpaceMeta, dataSpaceMeta, H5P_DEFAULT, block->header.tv_sec + (i * PKTPERPAIR));
@@ -405,7 +424,7 @@ void write_PHDataset(modulePairFile_t *modPair, HSD_output_block_t *block, int i
     //Create the dataspace of the data within memory
     H5Sselect_hyperslab(dataMSpaceModPair, H5S_SELECT_SET, mOffsetModPair, NULL, mCountModPair, NULL);
 
-    status = H5Dwrite(modPair->PHDataset, storageTypebit16, dataMSpacePH, dataSpacePH, H5P_DEFAULT, block->coinc_block + (i * PKTDATASIZE));
+    status = H5Dwrite(modPair->PHDataset, storageTypebit16, dataMSpacePH, dataSpacePH, H5P_DEFAULT, HSD_output_coinc_record(block, i));
     status = H5Dwrite(modPair->PHmodNum, H5T_STD_U16LE, dataMSpaceModPair, dataSpaceModPair, H5P_DEFAULT, block->header.coin_modNum + i);
     status = H5Dwrite(modPair->PHquaNum, H5T_STD_U8LE, dataMSpaceModPair, dataSpaceModPair, H5P_DEFAULT, block->header.coin_quaNum + i);
     status = H5Dwrite(modPair->PHpktNum, H5T_STD_U16LE, dataMSpaceModPair, dataSpaceModPair, H5P_DEFAULT, block->header.coin_pktNum + i);
@@ -593,6 +612,58 @@ const hid_t GPS_field_types[GPSFIELDS] = {
     get_H5T_string_type()  // TV_UTC
 };
 
+/**
+ * A PH coincidence event of a module pair as it is stored in the coincidence table.
+ */
+typedef struct PHCoincEvents {
+    uint16_t MOD1NUM;
+    uint16_t MOD2NUM;
+    uint8_t MULTIPLICITY;
+    uint8_t QUABOS;
+    uint32_t PKTUTC;
+    uint32_t PKTNSEC;
+    uint32_t SPAN;
+    uint16_t PKTNUM[PKTPERPAIR];
+} PHCoincEvents_t;
+
+const PHCoincEvents_t PHCoinc_dst_buf[0] = {};
+
+const size_t PHCoinc_dst_size = sizeof(PHCoincEvents_t);
+
+const size_t PHCoinc_dst_offset[PHCOINCFIELDS] = {HOFFSET(PHCoincEvents_t, MOD1NUM),
+                                                  HOFFSET(PHCoincEvents_t, MOD2NUM),
+                                                  HOFFSET(PHCoincEvents_t, MULTIPLICITY),
+                                                  HOFFSET(PHCoincEvents_t, QUABOS),
+                                                  HOFFSET(PHCoincEvents_t, PKTUTC),
+                                                  HOFFSET(PHCoincEvents_t, PKTNSEC),
+                                                  HOFFSET(PHCoincEvents_t, SPAN),
+                                                  HOFFSET(PHCoincEvents_t, PKTNUM)};
+
+const size_t PHCoinc_dst_sizes[PHCOINCFIELDS] = {sizeof(PHCoinc_dst_buf[0].MOD1NUM),
+                                                 sizeof(PHCoinc_dst_buf[0].MOD2NUM),
+                                                 sizeof(PHCoinc_dst_buf[0].MULTIPLICITY),
+                                                 sizeof(PHCoinc_dst_buf[0].QUABOS),
+                                                 sizeof(PHCoinc_dst_buf[0].PKTUTC),
+                                                 sizeof(PHCoinc_dst_buf[0].PKTNSEC),
+                                                 sizeof(PHCoinc_dst_buf[0].SPAN),
+                                                 sizeof(PHCoinc_dst_buf[0].PKTNUM)};
+
+const char *PHCoinc_field_names[PHCOINCFIELDS] = {"MOD1NUM", "MOD2NUM", "MULTIPLICITY", "QUABOS",
+                                                  "PKTUTC", "PKTNSEC", "SPAN", "PKTNUM"};
+
+hid_t get_H5T_pktNum_type() {
+    hsize_t dims[1] = {PKTPERPAIR};
+    return H5Tarray_create2(H5T_STD_U16LE, 1, dims);
+}
+
+const hid_t PHCoinc_field_types[PHCOINCFIELDS] = {
+    H5T_STD_U16LE, H5T_STD_U16LE,   // MOD1NUM, MOD2NUM
+    H5T_STD_U8LE, H5T_STD_U8LE,     // MULTIPLICITY, QUABOS
+    H5T_STD_U32LE, H5T_STD_U32LE,   // PKTUTC, PKTNSEC
+    H5T_STD_U32LE,                  // SPAN
+    get_H5T_pktNum_type()           // PKTNUM of each quabo of the pair, 0 for the quabos not in the event
+};
+
 /**
  * Create a singular string attribute attached to the given group.
  */
@@ -839,9 +910,45 @@ fileIDs_t *createNewFile(char *fileName, char *currTime) {
         printf("Created new file: %s\n", fileName);
     }
 
+    if (phCoincWindow > 0) {
+        PHCoincEvents_t PHCoinc_data;
+        if (H5TBmake_table(PHCOINC_TABLETITLE, newfile->PHData, PHCOINC_TABLENAME, PHCOINCFIELDS, 0,
+                           PHCoinc_dst_size, PHCoinc_field_names, PHCoinc_dst_offset, PHCoinc_field_types,
+                           100, NULL, 0, &PHCoinc_data) < 0) {
+            printf("Error: Unable to create PH coincidence table in HDF5 file.\n");
+            exit(1);
+        }
+        createNumAttribute(newfile->PHData, "coincidenceWindow", H5T_STD_U32LE, phCoincWindow);
+    }
+
     return newfile;
 }
 
+/**
+ * Append the PH coincidence events of the block to the coincidence table of the file.
+ */
+void write_PHCoincEvents(fileIDs_t *currFile, HSD_output_block_t *block) {
+    static PHCoincEvents_t events[PH_EVENT_PER_BLOCK];
+    HSD_output_block_header_t *header = &(block->header);
+    int n_events = header->phe_block_size;
+
+    for (int i = 0; i < n_events; i++) {
+        events[i].MOD1NUM = header->phe_modNum[i * 2];
+        events[i].MOD2NUM = header->phe_modNum[(i * 2) + 1];
+        events[i].MULTIPLICITY = header->phe_multiplicity[i];
+        events[i].QUABOS = header->phe_quabos[i];
+        events[i].PKTUTC = header->phe_pktUTC[i];
+        events[i].PKTNSEC = header->phe_pktNSEC[i];
+        events[i].SPAN = header->phe_span[i];
+        memcpy(events[i].PKTNUM, header->phe_pktNum + (i * PKTPERPAIR), sizeof(events[i].PKTNUM));
+    }
+
+    if (H5TBappend_records(currFile->PHData, PHCOINC_TABLENAME, n_events, PHCoinc_dst_size,
+                           PHCoinc_dst_offset, PHCoinc_dst_sizes, events) < 0) {
+        printf("Warning: Unable to append %i PH coincidence events to the HDF5 file.\n", n_events);
+    }
+}
+
 /**
  * Create new quabo tables within the HDF5 file located at the group.
  */
@@ -875,54 +982,288 @@ void createQuaboTables(hid_t group, modulePairFile_t *module) {
     }
 }
 
+//The module pairs of the config file
+static const HSD_topology_t *topo;
+
 /**
  * Create Module Pair Pointers from the config file
+ * @param moduleFileInd The module pair files indexed by module pair index
  */
 void create_ModPair(fileIDs_t *currFile, modulePairFile_t **moduleFileInd, modulePairFile_t *moduleLinkEnd) {
     //Initializing the Module Pairing using the config file given
-    FILE *modConfig_file = fopen(CONFIGFILE, "r");
-    char fbuf[100];
-    char cbuf;
-    unsigned int mod1Name;
-    unsigned int mod2Name;
-
-    if (modConfig_file == NULL) {
+    topo = HSD_topology_get();
+    if (topo == NULL) {
         perror("Error Opening Config File\n");
         exit(1);
     }
-    cbuf = getc(modConfig_file);
-    char moduleName[50];
 
-    while (cbuf != EOF) {
-        ungetc(cbuf, modConfig_file);
-        if (cbuf != '#') {
-            if (fscanf(modConfig_file, "%u %u\n", &mod1Name, &mod2Name) == 2) {
-                if (moduleFileInd[mod1Name] == NULL && moduleFileInd[mod2Name] == NULL) {
+    for (int pair = 0; pair < topo->n_pairs; pair++) {
+        unsigned int mod1Name = topo->module_num[pair * 2];
+        unsigned int mod2Name = topo->module_num[pair * 2 + 1];
 
-                    sprintf(moduleName, MODULEPAIR_FORMAT, mod1Name, mod2Name);
+        moduleFileInd[pair] = moduleLinkEnd->next_modulePairFile = modulePairFile_t_new(currFile, mod1Name, mod2Name);
 
-                    moduleFileInd[mod1Name] = moduleFileInd[mod2Name] = moduleLinkEnd->next_modulePairFile = modulePairFile_t_new(currFile, mod1Name, mod2Name);
+        moduleLinkEnd = moduleLinkEnd->next_modulePairFile;
 
-                    moduleLinkEnd = moduleLinkEnd->next_modulePairFile;
+        createQuaboTables(currFile->DynamicMeta, moduleLinkEnd);
 
-                    createQuaboTables(currFile->DynamicMeta, moduleLinkEnd);
+        printf("Created Module Pair: %u.%u-%u and %u.%u-%u\n",
+               (unsigned int)(mod1Name << 2) / 0x100, (mod1Name << 2) % 0x100, ((mod1Name << 2) % 0x100) + 3,
+               (mod2Name << 2) / 0x100, (mod2Name << 2) % 0x100, ((mod2Name << 2) % 0x100) + 3);
+    }
+}
 
-                    printf("Created Module Pair: %u.%u-%u and %u.%u-%u\n",
-                           (unsigned int)(mod1Name << 2) / 0x100, (mod1Name << 2) % 0x100, ((mod1Name << 2) % 0x100) + 3,
-                           (mod2Name << 2) / 0x100, (mod2Name << 2) % 0x100, ((mod2Name << 2) % 0x100) + 3);
-                }
+/**
+ * Store the published pixel statistics of the compute thread in the file. Each mode has a
+ * dataset of the mean, variance, min and max of the pixels of every quabo and the number of
+ * packets they are from. The quabos are listed by their boardloc. The compute thread closes
+ * the statistics for the file and starts them over for the next file.
+ */
+void writePixelStats(fileIDs_t *currFile) {
+    HSD_pixstats_t *stats = HSD_pixstats_get();
+    if (stats == NULL || topo == NULL) {
+        return;
+    }
+    const char *statsName[PIXSTATS_N_MODES] = {"bit16Stats", "bit8Stats"};
+    const char *countName[PIXSTATS_N_MODES] = {"bit16Count", "bit8Count"};
+    hsize_t n_quabos = stats->n_quabos;
+    hsize_t tableDim[3] = {n_quabos, PIXSTATS_FIELDS, SCIDATASIZE};
+
+    float *table = (float *)malloc(sizeof(float) * n_quabos * PIXSTATS_FIELDS * SCIDATASIZE);
+    uint64_t *count = (uint64_t *)malloc(sizeof(uint64_t) * n_quabos);
+    uint16_t *boardloc = (uint16_t *)malloc(sizeof(uint16_t) * n_quabos);
+    if (table == NULL || count == NULL || boardloc == NULL) {
+        printf("Warning: Unable to malloc space for the pixel statistics. Skipping their storage\n");
+        free(table);
+        free(count);
+        free(boardloc);
+        return;
+    }
+
+    int closed = (HSD_pixstats_close(stats, PIXSTATS_CLOSE_TIMEOUT_MS) == 0);
+    if (!closed) {
+        printf("Warning: The compute thread did not close the pixel statistics. Storing the last published ones\n");
+    }
+
+    hid_t group = H5Gcreate(currFile->file, PIXSTATS_GROUP, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (group < 0) {
+        printf("Warning: Unable to create the pixel statistics group. Skipping their storage\n");
+    } else {
+        for (hsize_t q = 0; q < n_quabos; q++) {
+            boardloc[q] = (topo->module_num[q / QUABOPERMODULE] << 2) | (q % QUABOPERMODULE);
+        }
+        H5LTmake_dataset(group, "boardloc", 1, &n_quabos, H5T_STD_U16LE, boardloc);
+
+        for (int mode = 0; mode < PIXSTATS_N_MODES; mode++) {
+            HSD_pixstats_read(stats, mode, table, count);
+            H5LTmake_dataset(group, statsName[mode], 3, tableDim, H5T_NATIVE_FLOAT, table);
+            H5LTmake_dataset(group, countName[mode], 1, &n_quabos, H5T_STD_U64LE, count);
+            fileSize += n_quabos * (PIXSTATS_FIELDS * SCIDATASIZE * 2 + 4);
+        }
+        H5Gclose(group);
+    }
+    if (closed) {
+        HSD_pixstats_release(stats);
+    }
+
+    free(table);
+    free(count);
+    free(boardloc);
+}
+
+/**
+ * A module pair frame kept for a short transient event.
+ */
+typedef struct transientFrame {
+    uint8_t status;
+    uint8_t trigger;
+    uint16_t pktNum[PKTPERPAIR];
+    uint32_t pktNSEC[PKTPERPAIR];
+    long int tv_sec[PKTPERPAIR];
+    long int tv_usec[PKTPERPAIR];
+    uint8_t data[MODPAIRDATASIZE];
+} transientFrame_t;
+
+/**
+ * The last frames of a module pair in one imaging mode. While no event is open the buffer keeps the
+ * TRIGPRE frames before a trigger. A trigger opens an event that takes the frames up to TRIGPOST
+ * frames after the last trigger, and the event is written to ShortTransient when it is closed.
+ * An event that fills the buffer is written in parts and stays open.
+ */
+typedef struct transientBuffer {
+    int first;                      //Oldest frame in the ring of frames
+    int n_frames;
+    int post_left;                  //Frames still to be added to the open event or -1 when none is open
+    int part;                       //Parts of the open event already written
+    transientFrame_t *frame;
+} transientBuffer_t;
+
+static int transientPre = 2;        //TRIGPRE
+static int transientPost = 2;       //TRIGPOST
+static int transientCapacity = 0;   //Frames of each buffer
+static transientBuffer_t *transients = NULL;    //Buffers of the module pairs, 16 bit then 8 bit, or NULL without trigger
+static unsigned int transientEvents = 0;        //Events written to the current file
+
+/**
+ * Allocate the transient buffers of the module pairs when the transient trigger is enabled.
+ */
+void transientInit(int triggerPixels) {
+    if (triggerPixels <= 0 || topo == NULL) {
+        return;
+    }
+    transientCapacity = transientPre + 1 + 2 * transientPost;
+    if (transientCapacity > TRANSIENT_MAX_FRAMES) {
+        transientCapacity = TRANSIENT_MAX_FRAMES;
+    }
+    transients = (transientBuffer_t *)calloc(topo->n_pairs * 2, sizeof(transientBuffer_t));
+    if (transients == NULL) {
+        printf("Warning: Unable to malloc space for the transient buffers. Skipping ShortTransient storage\n");
+        return;
+    }
+    for (int i = 0; i < topo->n_pairs * 2; i++) {
+        transients[i].post_left = -1;
+        transients[i].frame = (transientFrame_t *)malloc(sizeof(transientFrame_t) * transientCapacity);
+        if (transients[i].frame == NULL) {
+            printf("Warning: Unable to malloc space for the transient buffers. Skipping ShortTransient storage\n");
+            for (int j = 0; j < i; j++) {
+                free(transients[j].frame);
             }
+            free(transients);
+            transients = NULL;
+            return;
+        }
+    }
+}
+
+/**
+ * Write the frames of the open event in the buffer to the ShortTransient group and empty the buffer.
+ * The event stays open.
+ */
+void writeTransient(fileIDs_t *currFile, int pair, int mode, transientBuffer_t *buf) {
+    int n = buf->n_frames;
+    unsigned int data_size = HSD_modpair_data_size(mode);
+    uint8_t *data = (uint8_t *)malloc(data_size * n);
+    uint16_t *pktNum = (uint16_t *)malloc(sizeof(uint16_t) * PKTPERPAIR * n);
+    uint32_t *pktNSEC = (uint32_t *)malloc(sizeof(uint32_t) * PKTPERPAIR * n);
+    long int *tv_sec = (long int *)malloc(sizeof(long int) * PKTPERPAIR * n);
+    long int *tv_usec = (long int *)malloc(sizeof(long int) * PKTPERPAIR * n);
+    uint8_t *status = (uint8_t *)malloc(n);
+    uint8_t *trigger = (uint8_t *)malloc(n);
+    char name[80];
+
+    if (data == NULL || pktNum == NULL || pktNSEC == NULL || tv_sec == NULL || tv_usec == NULL || status == NULL || trigger == NULL) {
+        printf("Warning: Unable to malloc space for a transient event. Skipping the event\n");
+    } else {
+        for (int f = 0; f < n; f++) {
+            transientFrame_t *frame = &(buf->frame[(buf->first + f) % transientCapacity]);
+            memcpy(data + f * data_size, frame->data, data_size);
+            memcpy(pktNum + f * PKTPERPAIR, frame->pktNum, sizeof(frame->pktNum));
+            memcpy(pktNSEC + f * PKTPERPAIR, frame->pktNSEC, sizeof(frame->pktNSEC));
+            memcpy(tv_sec + f * PKTPERPAIR, frame->tv_sec, sizeof(frame->tv_sec));
+            memcpy(tv_usec + f * PKTPERPAIR, frame->tv_usec, sizeof(frame->tv_usec));
+            status[f] = frame->status;
+            trigger[f] = frame->trigger;
+        }
+
+        sprintf(name, TRANSIENT_EVENT_FORMAT, topo->module_num[pair * 2], topo->module_num[pair * 2 + 1], mode, transientEvents);
+        hid_t group = H5Gcreate(currFile->ShortTransient, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (group < 0) {
+            printf("Warning: Unable to create transient event %s. Skipping the event\n", name);
         } else {
-            if (fgets(fbuf, 100, modConfig_file) == NULL) {
-                break;
-            }
+            hsize_t dataDim[RANK] = {(hsize_t)n, PKTPERPAIR, SCIDATASIZE};
+            hsize_t metaDim[2] = {(hsize_t)n, PKTPERPAIR};
+            hsize_t frameDim[1] = {(hsize_t)n};
+            H5LTmake_dataset(group, "data", RANK, dataDim, (mode == 16) ? storageTypebit16 : storageTypebit8, data);
+            H5LTmake_dataset(group, "pktNum", 2, metaDim, H5T_STD_U16LE, pktNum);
+            H5LTmake_dataset(group, "pktNSEC", 2, metaDim, H5T_STD_U32LE, pktNSEC);
+            H5LTmake_dataset(group, "tv_sec", 2, metaDim, H5T_NATIVE_LONG, tv_sec);
+            H5LTmake_dataset(group, "tv_usec", 2, metaDim, H5T_NATIVE_LONG, tv_usec);
+            H5LTmake_dataset(group, "status", 1, frameDim, H5T_STD_U8LE, status);
+            H5LTmake_dataset(group, "trigger", 1, frameDim, H5T_STD_U8LE, trigger);
+            createNumAttribute(group, "part", H5T_STD_U32LE, buf->part);
+            H5Gclose(group);
+            fileSize += n * (data_size + PKTPERPAIR * 22 + 2) / 2;
+            transientEvents++;
+        }
+    }
+
+    free(data);
+    free(pktNum);
+    free(pktNSEC);
+    free(tv_sec);
+    free(tv_usec);
+    free(status);
+    free(trigger);
+
+    buf->first = 0;
+    buf->n_frames = 0;
+}
+
+/**
+ * Write the open event of the buffer and close it.
+ */
+void closeTransient(fileIDs_t *currFile, int pair, int mode, transientBuffer_t *buf) {
+    writeTransient(currFile, pair, mode, buf);
+    buf->post_left = -1;
+    buf->part = 0;
+}
+
+/**
+ * Add a module pair frame of the output block to the transient buffer of its pair and mode.
+ */
+void transientAdd(fileIDs_t *currFile, int pair, HSD_output_block_t *block, int i) {
+    int mode = block->header.acqmode[i];
+    transientBuffer_t *buf = &(transients[pair * 2 + ((mode == 16) ? 0 : 1)]);
+    int fire = block->header.trigger[i];
+
+    //Without an open event only the frames before a trigger are kept
+    if (buf->post_left < 0 && !fire && transientPre == 0) {
+        return;
+    }
+
+    transientFrame_t *frame = &(buf->frame[(buf->first + buf->n_frames) % transientCapacity]);
+    buf->n_frames++;
+    frame->status = block->header.status[i];
+    frame->trigger = fire;
+    memcpy(frame->pktNum, block->header.pktNum + i * PKTPERPAIR, sizeof(frame->pktNum));
+    memcpy(frame->pktNSEC, block->header.pktNSEC + i * PKTPERPAIR, sizeof(frame->pktNSEC));
+    memcpy(frame->tv_sec, block->header.tv_sec + i * PKTPERPAIR, sizeof(frame->tv_sec));
+    memcpy(frame->tv_usec, block->header.tv_usec + i * PKTPERPAIR, sizeof(frame->tv_usec));
+    memcpy(frame->data, HSD_output_stream_record(block, i), HSD_modpair_data_size(mode));
+
+    if (buf->post_left < 0) {
+        if (fire) {
+            buf->post_left = transientPost;
+        } else if (buf->n_frames > transientPre) {
+            buf->first = (buf->first + 1) % transientCapacity;
+            buf->n_frames--;
         }
-        cbuf = getc(modConfig_file);
+    } else {
+        buf->post_left = fire ? transientPost : buf->post_left - 1;
     }
 
-    if (fclose(modConfig_file) == EOF) {
-        printf("Warning: Unable to close module configuration file.\n");
+    //Close the event after the last frame it takes, or write the next part when the buffer is full
+    if (buf->post_left == 0) {
+        closeTransient(currFile, pair, mode, buf);
+    } else if (buf->post_left > 0 && buf->n_frames == transientCapacity) {
+        writeTransient(currFile, pair, mode, buf);
+        buf->part++;
+    }
+}
+
+/**
+ * Write the open events to the file before it is closed.
+ */
+void flushTransients(fileIDs_t *currFile) {
+    if (transients == NULL) {
+        return;
+    }
+    for (int i = 0; i < topo->n_pairs * 2; i++) {
+        if (transients[i].post_left >= 0) {
+            closeTransient(currFile, i / 2, (i % 2) ? 8 : 16, &(transients[i]));
+        }
     }
+    transientEvents = 0;
 }
 
 /**
@@ -1625,7 +1966,11 @@ fileIDs_t *HDF5file_init() {
     sprintf(fileName, "%s%04i/%04i%02i%02i/", saveLocation, (tm.tm_year + 1900), tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
     mkdir(fileName, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
     sprintf(currTime, TIME_FORMAT, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-    sprintf(fileName + strlen(fileName), H5FILE_NAME_FORMAT, OBSERVATORY, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    if (fileInstance >= 0) {
+        sprintf(fileName + strlen(fileName), H5FILE_INSTANCE_NAME_FORMAT, OBSERVATORY, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, fileInstance);
+    } else {
+        sprintf(fileName + strlen(fileName), H5FILE_NAME_FORMAT, OBSERVATORY, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
 
     if (access(fileName, F_OK) != -1) {
         printf("Error: Unable to access file location - %s", fileName);
@@ -1677,7 +2022,7 @@ fileIDs_t* reInitHDF5File(fileIDs_t* oldFile, modulePairFile_t* moduleFileListBe
         H5Gclose(modFileoldHeadptr->PHGroup);
 
         //Reinitate new ModFile Pairs
-        moduleFileIndex[modFileoldHeadptr->mod1Name] = moduleFileIndex[modFileoldHeadptr->mod2Name] 
+        moduleFileIndex[HSD_topology_pair(topo, modFileoldHeadptr->mod1Name)]
         = modFileEndptr->next_modulePairFile 
         = modulePairFile_t_new(new_file, modFileoldHeadptr->mod1Name, modFileoldHeadptr->mod2Name);
         createQuaboTables(new_file->DynamicMeta, modFileEndptr->next_modulePairFile);
@@ -1709,7 +2054,7 @@ static fileIDs_t *file;
 
 static modulePairFile_t *moduleFileListBegin;
 static modulePairFile_t *moduleFileListEnd;
-static modulePairFile_t *moduleFileIndex[MODULEINDEXSIZE] = {NULL};
+static modulePairFile_t *moduleFileIndex[TOPO_MAX_PAIRS] = {NULL};    //Module pair files indexed by module pair index
 
 static redisContext *redisServer;
 
@@ -1740,6 +2085,29 @@ static int init(hashpipe_thread_args_t *args)
     hgeti4(st.buf, "MAXFILESIZE", &maxSizeInput);
     maxFileSize = maxSizeInput * 2E6;
 
+    //Frames kept before and after the frames that fire the transient trigger of the compute thread
+    hgeti4(st.buf, "TRIGPIX", &triggerPixels);
+    hgeti4(st.buf, "TRIGPRE", &transientPre);
+    hgeti4(st.buf, "TRIGPOST", &transientPost);
+    if (transientPre < 0 || transientPost < 0 || transientPre + 1 + transientPost > TRANSIENT_MAX_FRAMES) {
+        printf("Warning: TRIGPRE=%i and TRIGPOST=%i are out of range. Using 2 frames before and after.\n", transientPre, transientPost);
+        transientPre = 2;
+        transientPost = 2;
+    }
+    hputi4(st.buf, "TRIGPRE", transientPre);
+    hputi4(st.buf, "TRIGPOST", transientPost);
+
+    //PH coincidence events are grouped by the compute thread when PHCWIN is set
+    hgeti4(st.buf, "PHCWIN", &phCoincWindow);
+
+    //Each instance in a fanout group writes its own share of the module pairs
+    int fanoutid = 0;
+    hgeti4(st.buf, "FANOUTID", &fanoutid);
+    if (fanoutid > 0) {
+        fileInstance = args->instance_id;
+        printf("Fanout Instance: %i\n", fileInstance);
+    }
+
     /*Initialization of Redis Server Values*/
     printf("------------------SETTING UP REDIS ------------------\n");
     redisServer = redisConnect("127.0.0.1", 6379);
@@ -1780,6 +2148,7 @@ static void *run(hashpipe_thread_args_t *args) {
     moduleFileListBegin = modulePairFile_t_new(file, -1, -1, 0);
     moduleFileListEnd = moduleFileListBegin;
     create_ModPair(file, moduleFileIndex, moduleFileListEnd);
+    transientInit(triggerPixels);
 
     getStaticRedisData(redisServer, file->StaticMeta);
 
@@ -1836,14 +2205,21 @@ static void *run(hashpipe_thread_args_t *args) {
 
         getDynamicRedisData(redisServer, moduleFileListBegin->next_modulePairFile, file->DynamicMeta);
         for (int i = 0; i < db->block[block_idx].header.stream_block_size; i++) {
-            if (moduleFileIndex[db->block[block_idx].header.modNum[i * 2]]) {
-                currModPairFile = moduleFileIndex[db->block[block_idx].header.modNum[i * 2]];
-                //printf("Mod1 Number is :%i Acqmode: %i\n", db->block[block_idx].header.modNum[i*2],
-                //                                            db->block[block_idx].header.acqmode[i]);
-            } else if (moduleFileIndex[db->block[block_idx].header.modNum[(i * 2) + 1]]) {
-                currModPairFile = moduleFileIndex[db->block[block_idx].header.modNum[(i * 2) + 1]];
-                //printf("Mod2 Number is :%i Acqmode: %i\n", db->block[block_idx].header.modNum[(i*2)+1],
-                //                                            db->block[block_idx].header.acqmode[i]);
+            //Records left without a frame by the compute thread are skipped
+            if (db->block[block_idx].header.status[i] == 0) {
+                continue;
+            }
+            int pair = HSD_topology_pair(topo, db->block[block_idx].header.modNum[i * 2]);
+            if (pair < 0) {
+                pair = HSD_topology_pair(topo, db->block[block_idx].header.modNum[(i * 2) + 1]);
+            }
+            if (pair < 0) {
+                continue;
+            }
+            currModPairFile = moduleFileIndex[pair];
+
+            if (transients != NULL) {
+                transientAdd(file, pair, &(db->block[block_idx]), i);
             }
 
             if (db->block[block_idx].header.acqmode[i] == 16) {
@@ -1858,7 +2234,7 @@ static void *run(hashpipe_thread_args_t *args) {
                 }
                 write_Dataset(currModPairFile, &(db->block[block_idx]), i);
                 currModPairFile->bit16ModPairIndex += 1;
-                fileSize += MODPAIRDATASIZE;
+                fileSize += HSD_modpair_data_size(16);
 
             } else if (db->block[block_idx].header.acqmode[i] == 8) {
                 #ifdef TEST_MODE
@@ -1869,13 +2245,17 @@ static void *run(hashpipe_thread_args_t *args) {
                 }
                 write_Dataset(currModPairFile, &(db->block[block_idx]), i);
                 currModPairFile->bit8ModPairIndex += 1;
-                fileSize += MODPAIRDATASIZE;
+                fileSize += HSD_modpair_data_size(8);
             }
         }
 
 
         for (int i = 0; i < db->block[block_idx].header.coinc_block_size; i++) {
-            currModPairFile = moduleFileIndex[db->block[block_idx].header.coin_modNum[i]];
+            int pair = HSD_topology_pair(topo, db->block[block_idx].header.coin_modNum[i]);
+            if (pair < 0) {
+                continue;
+            }
+            currModPairFile = moduleFileIndex[pair];
 
             if (currModPairFile->PHModPairIndex >= (int)PKTPERDATASET){
                 create_ModPair_Dataset(currModPairFile, 0);
@@ -1884,8 +2264,15 @@ static void *run(hashpipe_thread_args_t *args) {
             currModPairFile->PHModPairIndex += 1;
         }
 
+        if (phCoincWindow > 0 && db->block[block_idx].header.phe_block_size > 0) {
+            write_PHCoincEvents(file, &(db->block[block_idx]));
+            fileSize += db->block[block_idx].header.phe_block_size * sizeof(PHCoincEvents_t) / 2;
+        }
+
         if (QUITSIG || fileSize > maxFileSize) {
             printf("-----Start Reinitializing all File Resources----\n");
+            writePixelStats(file);
+            flushTransients(file);
             file = reInitHDF5File(file, moduleFileListBegin, moduleFileListEnd, moduleFileIndex);
             getStaticRedisData(redisServer, file->StaticMeta);
             printf("-----Reinitializing File Resources Complete----\n");
@@ -0,0 +1,148 @@
+/* HSD_pixstats.c
+ *
+ * Running statistics of every pixel of every quabo.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "HSD_pixstats.h"
+
+static HSD_pixstats_t *pixstats = NULL;
+static pthread_mutex_t pixstats_create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Start the statistics of the quabos over.
+ */
+static void pixstats_clear(HSD_pixstats_quabo_t *q, int n_quabos){
+    memset(q, 0, sizeof(HSD_pixstats_quabo_t)*n_quabos);
+    for (int i = 0; i < n_quabos; i++){
+        for (int p = 0; p < SCIDATASIZE; p++){
+            q[i].min[p] = UINT16_MAX;
+            q[i].max[p] = 0;
+        }
+    }
+}
+
+HSD_pixstats_t *HSD_pixstats_create(int n_quabos){
+    pthread_mutex_lock(&pixstats_create_lock);
+    if (pixstats == NULL){
+        HSD_pixstats_t *stats = (HSD_pixstats_t *)calloc(1, sizeof(HSD_pixstats_t));
+        int ok = (stats != NULL);
+        for (int m = 0; ok && m < PIXSTATS_N_MODES; m++){
+            stats->live[m] = (HSD_pixstats_quabo_t *)aligned_alloc(CACHE_ALIGNMENT, sizeof(HSD_pixstats_quabo_t)*n_quabos);
+            stats->published[m] = (HSD_pixstats_quabo_t *)aligned_alloc(CACHE_ALIGNMENT, sizeof(HSD_pixstats_quabo_t)*n_quabos);
+            ok = (stats->live[m] != NULL && stats->published[m] != NULL);
+            if (ok){
+                pixstats_clear(stats->live[m], n_quabos);
+                pixstats_clear(stats->published[m], n_quabos);
+            }
+        }
+        if (ok){
+            stats->n_quabos = n_quabos;
+            pthread_mutex_init(&(stats->lock), NULL);
+            pthread_cond_init(&(stats->closed), NULL);
+            __atomic_store_n(&pixstats, stats, __ATOMIC_RELEASE);
+        } else if (stats != NULL){
+            for (int m = 0; m < PIXSTATS_N_MODES; m++){
+                free(stats->live[m]);
+                free(stats->published[m]);
+            }
+            free(stats);
+        }
+    }
+    pthread_mutex_unlock(&pixstats_create_lock);
+    return HSD_pixstats_get();
+}
+
+HSD_pixstats_t *HSD_pixstats_get(){
+    return __atomic_load_n(&pixstats, __ATOMIC_ACQUIRE);
+}
+
+void HSD_pixstats_publish(HSD_pixstats_t *stats){
+    for (int m = 0; m < PIXSTATS_N_MODES; m++){
+        for (int i = 0; i < stats->n_quabos; i++){
+            HSD_pixstats_merge(&(stats->live[m][i]));
+        }
+    }
+
+    pthread_mutex_lock(&(stats->lock));
+    if (!stats->held){
+        for (int m = 0; m < PIXSTATS_N_MODES; m++){
+            memcpy(stats->published[m], stats->live[m], sizeof(HSD_pixstats_quabo_t)*stats->n_quabos);
+        }
+    }
+    if (stats->close_request){
+        for (int m = 0; m < PIXSTATS_N_MODES; m++){
+            pixstats_clear(stats->live[m], stats->n_quabos);
+        }
+        __atomic_store_n(&(stats->close_request), 0, __ATOMIC_RELAXED);
+        stats->held = 1;
+        stats->n_closed++;
+        pthread_cond_broadcast(&(stats->closed));
+    }
+    pthread_mutex_unlock(&(stats->lock));
+}
+
+void HSD_pixstats_finish(HSD_pixstats_t *stats){
+    HSD_pixstats_publish(stats);
+    pthread_mutex_lock(&(stats->lock));
+    stats->finished = 1;
+    pthread_cond_broadcast(&(stats->closed));
+    pthread_mutex_unlock(&(stats->lock));
+}
+
+int HSD_pixstats_close(HSD_pixstats_t *stats, int timeout_ms){
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&(stats->lock));
+    uint64_t n_closed = stats->n_closed;
+    int rv = 0;
+    if (!stats->finished){
+        __atomic_store_n(&(stats->close_request), 1, __ATOMIC_RELAXED);
+    }
+    while (stats->n_closed == n_closed && !stats->finished && rv == 0){
+        rv = pthread_cond_timedwait(&(stats->closed), &(stats->lock), &deadline);
+    }
+    int closed = (stats->n_closed != n_closed || stats->finished);
+    if (closed){
+        stats->held = 1;
+    } else {
+        __atomic_store_n(&(stats->close_request), 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&(stats->lock));
+    return closed ? 0 : -1;
+}
+
+void HSD_pixstats_release(HSD_pixstats_t *stats){
+    pthread_mutex_lock(&(stats->lock));
+    stats->held = 0;
+    pthread_mutex_unlock(&(stats->lock));
+}
+
+void HSD_pixstats_read(HSD_pixstats_t *stats, int mode, float *table, uint64_t *count){
+    pthread_mutex_lock(&(stats->lock));
+    for (int i = 0; i < stats->n_quabos; i++){
+        const HSD_pixstats_quabo_t *q = &(stats->published[mode][i]);
+        float *mean = table + (i*PIXSTATS_FIELDS)*SCIDATASIZE;
+        float *var = mean + SCIDATASIZE;
+        float *min = var + SCIDATASIZE;
+        float *max = min + SCIDATASIZE;
+        count[i] = q->n;
+        for (int p = 0; p < SCIDATASIZE; p++){
+            mean[p] = (float)q->mean[p];
+            var[p] = (q->n > 1) ? (float)(q->m2[p] / (q->n - 1)) : 0.0f;
+            min[p] = q->n ? q->min[p] : 0.0f;
+            max[p] = q->n ? q->max[p] : 0.0f;
+        }
+    }
+    pthread_mutex_unlock(&(stats->lock));
+}
@@ -0,0 +1,176 @@
+/* HSD_pixstats.h
+ *
+ * Running statistics of every pixel of every quabo, kept by the compute thread
+ * while it assembles the imaging packets. Each packet is added in float with SIMD
+ * to the sums of a short batch, taken around the mean at the start of the batch.
+ * Full batches are merged into the mean and the sum of squares, which are kept in
+ * double. A float running mean stops moving once delta/n falls below half an ulp,
+ * which for a mean around 1000 happens after about 1e6 packets, so gain drifts
+ * would go unnoticed after minutes of imaging.
+ *
+ * The compute workers update the live statistics of the quabos of their own module
+ * pairs. The compute thread copies them to a published snapshot at a set interval
+ * while the workers are idle, and the other threads only read the snapshot. When the
+ * output thread closes a file it asks the compute thread to close the statistics: the
+ * next publish takes the snapshot and starts the live statistics over at once, so no
+ * packet is left out of both files.
+ */
+
+#ifndef _HSD_PIXSTATS_H
+#define _HSD_PIXSTATS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "HSD_databuf.h"
+
+#define PIXSTATS_MODE_16BIT     0                       //Statistics of the 16 bit imaging modes
+#define PIXSTATS_MODE_8BIT      1                       //Statistics of the 8 bit imaging modes
+#define PIXSTATS_N_MODES        2
+#define PIXSTATS_FIELDS         4                       //Mean, variance, min and max of each pixel
+#define PIXSTATS_BATCH          32                      //Packets summed in float before they are merged
+
+/**
+ * Running statistics of the pixels of a quabo.
+ */
+typedef struct HSD_pixstats_quabo {
+    //The pixel arrays come first to keep them aligned for the SIMD loads
+    float shift[SCIDATASIZE];                       //Mean at the start of the batch
+    float sum[SCIDATASIZE];                         //Sum of the differences from the shift over the batch
+    float sumsq[SCIDATASIZE];                       //Sum of the squared differences from the shift
+    uint16_t min[SCIDATASIZE];                      //Pixels are integers of at most 16 bit
+    uint16_t max[SCIDATASIZE];
+    double mean[SCIDATASIZE];
+    double m2[SCIDATASIZE];                         //Sum of the squared differences from the mean
+    uint64_t n;                                     //Number of packets merged into the mean
+    int n_batch;                                    //Number of packets in the batch
+    int skip;                                       //Packets to skip before the next update, see PIXSTDEC
+} __attribute__((aligned(CACHE_ALIGNMENT))) HSD_pixstats_quabo_t;
+
+typedef struct HSD_pixstats {
+    int n_quabos;                                   //Quabos of the topology by quabo index
+    HSD_pixstats_quabo_t *live[PIXSTATS_N_MODES];   //Updated by the compute workers
+    HSD_pixstats_quabo_t *published[PIXSTATS_N_MODES];
+    pthread_mutex_t lock;                           //Guards the published snapshot and the fields below
+    pthread_cond_t closed;                          //Signaled when the statistics were closed
+    int close_request;                              //Set to close the statistics at the next publish
+    int held;                                       //Set while the closed snapshot is read, it is not replaced
+    int finished;                                   //Set when the compute thread stopped publishing
+    uint64_t n_closed;                              //Number of times the statistics were closed
+} HSD_pixstats_t;
+
+/**
+ * Create the statistics shared by all threads. Only the first call creates them.
+ * @param n_quabos The number of quabos of the topology
+ * @return The statistics or NULL if they could not be allocated
+ */
+HSD_pixstats_t *HSD_pixstats_create(int n_quabos);
+
+/**
+ * The statistics shared by all threads.
+ * @return The statistics or NULL if they were not created
+ */
+HSD_pixstats_t *HSD_pixstats_get();
+
+/**
+ * Merge the batches and copy the live statistics to the published snapshot. When a close was
+ * requested the live statistics are started over and the snapshot is held until it is released.
+ * Must not be called while the live statistics are updated.
+ */
+void HSD_pixstats_publish(HSD_pixstats_t *stats);
+
+/**
+ * Publish the statistics a last time and let HSD_pixstats_close return without waiting.
+ * Called when the compute thread stops.
+ */
+void HSD_pixstats_finish(HSD_pixstats_t *stats);
+
+/**
+ * Check if the output thread waits for the statistics to be closed.
+ */
+static inline int HSD_pixstats_close_requested(HSD_pixstats_t *stats){
+    return __atomic_load_n(&(stats->close_request), __ATOMIC_RELAXED);
+}
+
+/**
+ * Ask the compute thread to close the statistics and wait until it did. The published snapshot
+ * then holds the statistics since the last close until HSD_pixstats_release is called.
+ * @param timeout_ms Time to wait for the compute thread
+ * @return 0 when the statistics were closed, -1 if the compute thread did not close them in time
+ */
+int HSD_pixstats_close(HSD_pixstats_t *stats, int timeout_ms);
+
+/**
+ * Let the publishes replace the closed snapshot again.
+ */
+void HSD_pixstats_release(HSD_pixstats_t *stats);
+
+/**
+ * Read the published snapshot of a mode as a table of mean, variance, min and max.
+ * @param table n_quabos*PIXSTATS_FIELDS*SCIDATASIZE values
+ * @param count The number of packets of each quabo
+ */
+void HSD_pixstats_read(HSD_pixstats_t *stats, int mode, float *table, uint64_t *count);
+
+/**
+ * Merge the batch of the quabo into its mean and sum of squares (Chan et al.)
+ * and start the next batch around the new mean.
+ */
+static inline void HSD_pixstats_merge(HSD_pixstats_quabo_t *q){
+    if (q->n_batch == 0){
+        return;
+    }
+    float *__restrict shift = q->shift;
+    float *__restrict sum = q->sum;
+    float *__restrict sumsq = q->sumsq;
+    double *__restrict mean = q->mean;
+    double *__restrict m2 = q->m2;
+    const double n_batch = q->n_batch;
+    const double inv_batch = 1.0 / n_batch;
+    const double n = q->n + n_batch;
+    const double w_mean = n_batch / n;
+    const double w_m2 = q->n * n_batch / n;
+    for (int i = 0; i < SCIDATASIZE; i++){
+        double batch_offset = sum[i] * inv_batch;
+        double batch_m2 = sumsq[i] - sum[i] * batch_offset;
+        double delta = shift[i] + batch_offset - mean[i];
+        mean[i] += delta * w_mean;
+        m2[i] += batch_m2 + delta * delta * w_m2;
+        shift[i] = (float)mean[i];
+        sum[i] = 0.0f;
+        sumsq[i] = 0.0f;
+    }
+    q->n += q->n_batch;
+    q->n_batch = 0;
+}
+
+/**
+ * Add the pixels of a packet to the running statistics of its quabo.
+ * The loops have no dependencies between pixels so they are vectorized.
+ */
+template<typename PIXEL>
+static inline void HSD_pixstats_update(HSD_pixstats_quabo_t *q, const PIXEL *__restrict pixels){
+    float *__restrict shift = q->shift;
+    float *__restrict sum = q->sum;
+    float *__restrict sumsq = q->sumsq;
+    uint16_t *__restrict min = q->min;
+    uint16_t *__restrict max = q->max;
+    //The first packet is the shift of the first batch, so the sums stay small
+    if (q->n == 0 && q->n_batch == 0){
+        for (int i = 0; i < SCIDATASIZE; i++){
+            shift[i] = pixels[i];
+        }
+    }
+    for (int i = 0; i < SCIDATASIZE; i++){
+        uint16_t p = pixels[i];
+        float d = p - shift[i];
+        sum[i] += d;
+        sumsq[i] += d * d;
+        min[i] = (p < min[i]) ? p : min[i];
+        max[i] = (p > max[i]) ? p : max[i];
+    }
+    if (++(q->n_batch) >= PIXSTATS_BATCH){
+        HSD_pixstats_merge(q);
+    }
+}
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * HSD_replay_thread.c
+ *
+ * The replay thread which is used in place of the net thread to read packets
+ * from a capture file recorded by the net thread. The packets are written
+ * into the shared memory blocks at their original timing, at a scaled rate
+ * or as fast as possible.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "hashpipe.h"
+#include "HSD_databuf.h"
+#include "HSD_capture.h"
+
+#define REPLAY_BUF_SIZE     2048    //Max payload length read from the capture file
+#define REPLAY_SPIN_NS      50000   //Time before a packet is due that is busy waited instead of slept
+
+/**
+ * Read the monotonic clock in ns.
+ */
+static inline uint64_t monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Wait until the monotonic clock reaches the due time of the next packet.
+ * Long waits sleep and the last REPLAY_SPIN_NS is busy waited.
+ */
+static void replay_wait_until(uint64_t due_ns){
+    uint64_t now = monotonic_ns();
+    if (due_ns > now + REPLAY_SPIN_NS){
+        struct timespec ts;
+        uint64_t wake = due_ns - REPLAY_SPIN_NS;
+        ts.tv_sec = wake / 1000000000ULL;
+        ts.tv_nsec = wake % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    while (monotonic_ns() < due_ns);
+}
+
+/**
+ * Check if the acqmode is one of the recognized modes (1,2,3,6,7).
+ */
+static inline int valid_acqmode(unsigned char acqmode){
+    return acqmode == 1 || acqmode == 2 || acqmode == 3 ||
+           acqmode == 6 || acqmode == 7;
+}
+
+/**
+ * Close the capture file when the thread is cancelled.
+ */
+static void replay_capture_close(void *arg){
+    HSD_capture_close((HSD_capture_t *)arg);
+}
+
+/**
+ * Initialization function for Hashpipe. This function is called once when the thread is created
+ * @param args Arugments passed in by hashpipe framework.
+ * @return 0 for success or returns -1 for failure
+ */
+static int init(hashpipe_thread_args_t * args){
+    char replfile[256];
+    double replrate = 1.0;
+    int replloop = 1;
+    hashpipe_status_t st = args->st;
+    replfile[0] = '\0';
+
+    //Locking shared buffer to properly get and set values.
+    hashpipe_status_lock_safe(&st);
+
+    // Get info from status buffer if present
+    hgets(st.buf, "REPLFILE", sizeof(replfile), replfile);
+    hgetr8(st.buf, "REPLRATE", &replrate);
+    hgeti4(st.buf, "REPLLOOP", &replloop);
+
+    //Store the replay info in status buffer
+    hputs(st.buf, "REPLFILE", replfile);
+    hputr8(st.buf, "REPLRATE", replrate);
+    hputi4(st.buf, "REPLLOOP", replloop);
+    hputi8(st.buf, "NPACKETS", 0);
+
+    //Unlocking shared buffer once complete.
+    hashpipe_status_unlock_safe(&st);
+
+    if (!replfile[0]){
+        hashpipe_error("HSD_replay_thread", "REPLFILE is not set.");
+        return -1;
+    }
+
+    // Initialize the the starting values of the input buffer.
+    HSD_input_databuf_t *db  = (HSD_input_databuf_t *)args->obuf;
+    for (int i = 0 ; i < db->header.n_block; i++){
+        db->block[i].header.INTSIG = 0;
+    }
+    printf("-----------Finished Setup of Replay Thread------------\n\n");
+    return 0;
+}
+
+static int INTSIG;
+
+static void INThandler(int signum __attribute__((unused))) {
+    INTSIG = 1;
+}
+
+static void *run(hashpipe_thread_args_t * args){
+    signal(SIGINT, INThandler);
+    INTSIG = 0;
+
+    printf("\n---------------Running Replay Thread-----------------\n\n");
+    //Creating pointers hashpipe args
+    HSD_input_databuf_t *db  = (HSD_input_databuf_t *)args->obuf;
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    //Variables
+    int rv;
+    uint64_t mcnt = 0;          //Mcount of
+    int block_idx = 0;          //The input buffer block index
+    HSD_input_block_header_t* blockHeader;
+    char replfile[256];
+    double replrate = 1.0;      //Replay speed relative to the capture, 0 for as fast as possible
+    int replloop = 1;           //Number of passes over the file, 0 for forever
+    int pass = 0;               //Passes over the file that have been started
+    int done = 0;               //The last packet of the last pass has been stored
+    uint64_t npackets = 0;
+    unsigned char pkt_data[REPLAY_BUF_SIZE];
+    unsigned int pkt_len;
+    uint64_t recv_ns;
+    uint64_t first_ns = 0;      //Capture time of the first packet of the pass
+    uint64_t start_ns = 0;      //Monotonic time the pass was started
+    replfile[0] = '\0';
+
+    hashpipe_status_lock_safe(&st);
+    hgets(st.buf, "REPLFILE", sizeof(replfile), replfile);
+    hgetr8(st.buf, "REPLRATE", &replrate);
+    hgeti4(st.buf, "REPLLOOP", &replloop);
+    hputs(st.buf, status_key, "running");
+    hashpipe_status_unlock_safe(&st);
+
+    int pkts_per_block = HSD_input_pkts_per_block(&st);  // Packets put in each input block
+
+    HSD_capture_t capture;
+    if (HSD_capture_open(&capture, replfile) != HASHPIPE_OK){
+        hashpipe_error(__FUNCTION__, "error opening replay file");
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push(replay_capture_close, &capture);
+    printf("Replaying %s at rate %g for %i passes\n", replfile, replrate, replloop);
+    pass = 1;
+
+    /* Main Loop */
+    while(run_threads()){
+
+        //Update the info of the buffer
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "waiting");
+        hputi4(st.buf, "REPBKOUT", block_idx);
+        hputi8(st.buf, "REPMCNT", mcnt);
+        hputi8(st.buf, "NPACKETS", npackets);
+        hputi4(st.buf, "REPLPASS", pass);
+        hashpipe_status_unlock_safe(&st);
+
+        // Wait for the new block to be free
+        while ((rv=HSD_input_databuf_wait_free(db, block_idx)) != HASHPIPE_OK) {
+            if (rv==HASHPIPE_TIMEOUT) {
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "blocked");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            } else {
+                hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+                pthread_exit(NULL);
+                break;
+            }
+        }
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "receiving");
+        hashpipe_status_unlock_safe(&st);
+
+        blockHeader = &(db->block[block_idx].header);
+        blockHeader->data_block_size = 0;
+
+        // Fill the buffer block from the capture file
+        int i = 0;
+        while (i < pkts_per_block){
+            if(INTSIG || !run_threads()) break;
+
+            rv = HSD_capture_read(&capture, &recv_ns, pkt_data, sizeof(pkt_data), &pkt_len);
+            if (rv < 0){
+                hashpipe_error(__FUNCTION__, "error reading replay file");
+                done = 1;
+                break;
+            }
+            if (rv == 0){
+                //Start the next pass over the file or finish the replay
+                if (replloop > 0 && pass >= replloop){
+                    done = 1;
+                    break;
+                }
+                if (HSD_capture_rewind(&capture) != HASHPIPE_OK){
+                    hashpipe_error(__FUNCTION__, "error rewinding replay file");
+                    done = 1;
+                    break;
+                }
+                pass++;
+                start_ns = 0;
+                continue;
+            }
+
+            if (!valid_acqmode(pkt_data[0]) || pkt_len < HSD_packet_size(pkt_data[0])) continue;
+
+            //Keep the spacing of the packets in the capture scaled by the rate
+            if (replrate > 0){
+                if (start_ns == 0){
+                    start_ns = monotonic_ns();
+                    first_ns = recv_ns;
+                }
+                if (recv_ns > first_ns){
+                    replay_wait_until(start_ns + (uint64_t)((recv_ns - first_ns) / replrate));
+                }
+            }
+
+            //The packets keep the receive time of the capture
+            HSD_input_block_store(&(db->block[block_idx]), i, pkt_data, recv_ns);
+            npackets++;
+            i++;
+        }
+
+        //Signal the end of the replay downstream with the last block
+        if (done) INTSIG = 1;
+        blockHeader->INTSIG = INTSIG;
+
+        //Mark block as full
+        if(HSD_input_databuf_set_filled(db, block_idx) != HASHPIPE_OK){
+            hashpipe_error(__FUNCTION__, "error waiting for databuf filled call");
+            pthread_exit(NULL);
+        }
+
+        db->block[block_idx].header.mcnt = mcnt;
+        block_idx = (block_idx + 1) % db->header.n_block;
+        mcnt++;
+
+        //Will exit if thread has been cancelled
+        pthread_testcancel();
+
+        //Break out when SIGINT is found or the replay is done
+        if(INTSIG){
+            printf("REPLAY_THREAD Ended after %lu packets\n", npackets);
+            break;
+        }
+    }
+
+    hashpipe_status_lock_safe(&st);
+    hputi8(st.buf, "NPACKETS", npackets);
+    hputs(st.buf, status_key, "done");
+    hashpipe_status_unlock_safe(&st);
+
+    pthread_cleanup_pop(1); /* Closes push(replay_capture_close) */
+
+    printf("Returned Replay_thread\n");
+    //Thread success!
+    return THREAD_OK;
+}
+
+/**
+ * Sets the functions and buffers for this thread
+ */
+static hashpipe_thread_desc_t HSD_replay_thread = {
+    name: "HSD_replay_thread",
+    skey: "REPLSTAT",
+    init: init,
+    run: run,
+    ibuf_desc: {NULL},
+    obuf_desc: {HSD_input_databuf_create}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&HSD_replay_thread);
+}
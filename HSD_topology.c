@@ -0,0 +1,75 @@
+/* HSD_topology.c
+ *
+ * The topology of the observatory read from the module pair config file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "HSD_topology.h"
+
+int HSD_topology_load(HSD_topology_t *topo, const char *config_file){
+    FILE *modConfig_file = fopen(config_file, "r");
+    char fbuf[100];
+    char cbuf;
+    unsigned int mod1Name;
+    unsigned int mod2Name;
+
+    topo->n_pairs = 0;
+    topo->n_modules = 0;
+    memset(topo->module_index, 0xff, sizeof(topo->module_index));
+
+    if (modConfig_file == NULL) {
+        return HASHPIPE_ERR_SYS;
+    }
+    cbuf = getc(modConfig_file);
+
+    while(cbuf != EOF){
+        ungetc(cbuf, modConfig_file);
+        if (cbuf != '#'){
+            if (fscanf(modConfig_file, "%u %u\n", &mod1Name, &mod2Name) == 2){
+                if (mod1Name >= TOPO_MODULE_SPACE || mod2Name >= TOPO_MODULE_SPACE || mod1Name == mod2Name){
+                    printf("Warning: Module pair %u %u of the config file is invalid and skipped.\n", mod1Name, mod2Name);
+                } else if (topo->module_index[mod1Name] != TOPO_NONE || topo->module_index[mod2Name] != TOPO_NONE){
+                    printf("Warning: Module pair %u %u of the config file reuses a module and is skipped.\n", mod1Name, mod2Name);
+                } else if (topo->n_pairs >= TOPO_MAX_PAIRS){
+                    printf("Warning: Only the first %i module pairs of the config file are used.\n", TOPO_MAX_PAIRS);
+                    break;
+                } else {
+                    topo->module_index[mod1Name] = topo->n_modules;
+                    topo->module_num[topo->n_modules++] = mod1Name;
+                    topo->module_index[mod2Name] = topo->n_modules;
+                    topo->module_num[topo->n_modules++] = mod2Name;
+                    topo->n_pairs++;
+                }
+            }
+        } else {
+            if (fgets(fbuf, 100, modConfig_file) == NULL){
+                break;
+            }
+        }
+        cbuf = getc(modConfig_file);
+    }
+
+    if (fclose(modConfig_file) == EOF){
+        printf("Warning: Unable to close module configuration file.\n");
+    }
+    return HASHPIPE_OK;
+}
+
+static HSD_topology_t topology;
+static int topology_status = HASHPIPE_ERR_SYS;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+static void topology_init(){
+    topology_status = HSD_topology_load(&topology, CONFIGFILE);
+    if (topology_status != HASHPIPE_OK){
+        hashpipe_error(__FUNCTION__, "unable to open config file %s", CONFIGFILE);
+    }
+}
+
+const HSD_topology_t *HSD_topology_get(){
+    pthread_once(&topology_once, topology_init);
+    return (topology_status == HASHPIPE_OK) ? &topology : NULL;
+}
@@ -0,0 +1,79 @@
+/* HSD_topology.h
+ *
+ * The topology of the observatory read from the module pair config file. Modules,
+ * module pairs and quabos are given small dense indices so the threads can keep
+ * their per pair and per quabo state in contiguous arrays instead of sparse tables
+ * indexed by the module number.
+ *
+ * Module pair p is made of the modules 2p and 2p+1, and quabo q of module m has the
+ * index 4m+q.
+ */
+
+#ifndef _HSD_TOPOLOGY_H
+#define _HSD_TOPOLOGY_H
+
+#include <stdint.h>
+#include "hashpipe.h"
+#include "HSD_databuf.h"
+
+#define TOPO_MAX_PAIRS          256                             //Max number of module pairs in the config file
+#define TOPO_MAX_MODULES        (TOPO_MAX_PAIRS*2)
+#define TOPO_MAX_QUABOS         (TOPO_MAX_MODULES*QUABOPERMODULE)
+#define TOPO_MODULE_SPACE       0x4000                          //Module numbers are the upper 14 bits of the boardloc
+#define TOPO_NONE               0xffff                          //Index of modules not in the config file
+
+/**
+ * The module pairs of the config file.
+ */
+typedef struct HSD_topology {
+    int n_pairs;
+    int n_modules;                                  //Always 2*n_pairs
+    uint16_t module_num[TOPO_MAX_MODULES];          //Module number of each module index
+    uint16_t module_index[TOPO_MODULE_SPACE];       //Module index of each module number or TOPO_NONE
+} HSD_topology_t;
+
+/**
+ * Read the module pairs from a config file. Pairs with a module that is already
+ * part of an earlier pair are skipped.
+ * @param topo The topology to be filled
+ * @param config_file The module pair config file
+ * @return HASHPIPE_OK on success and HASHPIPE_ERR_SYS if the file could not be opened
+ */
+int HSD_topology_load(HSD_topology_t *topo, const char *config_file);
+
+/**
+ * The topology of CONFIGFILE shared by all threads. It is read on the first call.
+ * @return The topology or NULL if the config file could not be read
+ */
+const HSD_topology_t *HSD_topology_get();
+
+/**
+ * Module index of a module number.
+ * @return The index or -1 if the module is not in the config file
+ */
+static inline int HSD_topology_module(const HSD_topology_t *topo, unsigned int modNum){
+    if (modNum >= TOPO_MODULE_SPACE || topo->module_index[modNum] == TOPO_NONE){
+        return -1;
+    }
+    return topo->module_index[modNum];
+}
+
+/**
+ * Module pair index of a module number.
+ * @return The index or -1 if the module is not in the config file
+ */
+static inline int HSD_topology_pair(const HSD_topology_t *topo, unsigned int modNum){
+    int module = HSD_topology_module(topo, modNum);
+    return (module < 0) ? -1 : module / 2;
+}
+
+/**
+ * Quabo index of a boardloc.
+ * @return The index or -1 if the module of the quabo is not in the config file
+ */
+static inline int HSD_topology_quabo(const HSD_topology_t *topo, uint16_t boardloc){
+    int module = HSD_topology_module(topo, boardloc >> 2);
+    return (module < 0) ? -1 : module * QUABOPERMODULE + (boardloc & 0x03);
+}
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Microbenchmark of the module pair assembly of the compute thread.
+ *
+ * Input blocks of 16 bit, 8 bit, PH and mixed packets are assembled over and over
+ * into an output block, once with storeData deciding the mode of each packet and
+ * once with the kernels computeShard picks for each run of packets. Both must
+ * give the same output block, the benchmark fails if they do not. The rate is
+ * printed in packets/s as the median of the repeated runs. The pixel statistics
+ * are kept when pixstats is 1.
+ *
+ * Usage: computeBenchmark [blocks] [pixstats] [repeats]
+ */
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include "HSD_compute_thread.c"
+
+#define BENCH_PAIRS         40      //Module pairs in the topology, a 16 bit block holds one frame of each
+#define BENCH_BLOCKS        20000   //Default number of input blocks assembled per run
+#define BENCH_REPEATS       5       //Default number of runs the median rate is taken over
+
+using namespace std;
+
+static HSD_topology_t benchTopology;
+
+/**
+ * Set up the topology of the module pairs 1-2, 3-4, ... and their assembly state.
+ */
+static void setupPairs(){
+    HSD_topology_t* t = &benchTopology;
+    t->n_pairs = BENCH_PAIRS;
+    t->n_modules = 2*BENCH_PAIRS;
+    memset(t->module_index, 0xff, sizeof(t->module_index));
+    for (int m = 0; m < t->n_modules; m++){
+        t->module_num[m] = m + 1;
+        t->module_index[m + 1] = m;
+    }
+    topo = t;
+
+    modulePairs = (modulePairData_t*)malloc(sizeof(modulePairData_t)*topo->n_pairs);
+    for (int p = 0; p < topo->n_pairs; p++){
+        modulePairData_init(&(modulePairs[p]), 2*p + 1, 2*p + 2);
+    }
+    workers.n_workers = 1;
+    asm_window = 1;
+    asm_max_age_ns = 0;
+}
+
+/**
+ * Fill the input block with complete frames. Acqmode 0 alternates 16 bit and 8 bit frames.
+ */
+static void fillBlock(HSD_input_block_t* in_block, unsigned char acqmode){
+    const int pkts_per_pair = PKTPERPAIR;
+    unsigned char pkt_data[HEADERSIZE + PKTDATASIZE];
+    in_block->header.data_block_size = 0;
+    for (int i = 0; i < IN_PKT_PER_BLOCK; i++){
+        int frame = i / pkts_per_pair;
+        int quabo = i % pkts_per_pair;
+        int pair = frame % BENCH_PAIRS;
+        unsigned int modNum = 2*pair + 1 + quabo / QUABOPERMODULE;
+        uint16_t boardloc = (modNum << 2) | (quabo % QUABOPERMODULE);
+        uint32_t nanosec = 1000*frame;
+
+        memset(pkt_data, i, sizeof(pkt_data));
+        pkt_data[0] = acqmode ? acqmode : ((frame % 2) ? 0x6 : 0x2);
+        pkt_data[2] = i & 0xff;
+        pkt_data[3] = (i >> 8) & 0xff;
+        pkt_data[4] = boardloc & 0xff;
+        pkt_data[5] = (boardloc >> 8) & 0xff;
+        memset(pkt_data + 6, 0, 4);
+        memcpy(pkt_data + 10, &nanosec, sizeof(nanosec));
+        HSD_input_block_store(in_block, i, pkt_data, 1000*(uint64_t)i);
+    }
+}
+
+/**
+ * Assemble the block with storeData deciding the mode of each packet.
+ */
+static void runStoreData(HSD_input_block_t* in_block, HSD_output_block_t* out_block){
+    for (int i = 0; i < in_block->header.data_block_size; i++){
+        int pair = HSD_topology_pair(topo, HSD_pkt_modnum(&(in_block->header.pkt[i])));
+        if (pair >= 0){
+            storeData(&(modulePairs[pair]), in_block, out_block, i);
+        }
+    }
+}
+
+/**
+ * Assemble the block with the kernels picked for each run of packets.
+ */
+static void runKernels(HSD_input_block_t* in_block, HSD_output_block_t* out_block){
+    computeShard(0, in_block, out_block, 0);
+}
+
+/**
+ * Assemble the block into an empty output block from a fresh assembly state and
+ * write out every frame still in flight.
+ */
+static void assembleOnce(void (*assemble)(HSD_input_block_t*, HSD_output_block_t*),
+                         HSD_input_block_t* in_block, HSD_output_block_t* out_block){
+    for (int p = 0; p < topo->n_pairs; p++){
+        modulePairData_init(&(modulePairs[p]), 2*p + 1, 2*p + 2);
+    }
+    memset(&(out_block->header), 0, sizeof(out_block->header));
+    resetOutputBlock(out_block, 0);
+    assemble(in_block, out_block);
+    computeShard(0, NULL, out_block, UINT64_MAX);
+}
+
+/**
+ * Compare two output blocks record by record.
+ * @return The name of the first field that differs or NULL if the blocks are the same
+ */
+static const char* compareBlocks(const HSD_output_block_t* a, const HSD_output_block_t* b, int* record){
+    const HSD_output_block_header_t* ha = &(a->header);
+    const HSD_output_block_header_t* hb = &(b->header);
+    *record = -1;
+    if (ha->stream_block_size != hb->stream_block_size) return "stream_block_size";
+    if (ha->coinc_block_size != hb->coinc_block_size) return "coinc_block_size";
+    if (ha->phe_block_size != hb->phe_block_size) return "phe_block_size";
+
+    for (int i = 0; i < ha->stream_block_size; i++){
+        const int m = i*PKTPERPAIR;
+        *record = i;
+        if (ha->status[i] != hb->status[i]) return "status";
+        if (ha->status[i] == 0) continue;
+        if (memcmp(ha->modNum + i*2, hb->modNum + i*2, 2*sizeof(ha->modNum[0]))) return "modNum";
+        if (ha->acqmode[i] != hb->acqmode[i]) return "acqmode";
+        if (ha->trigger[i] != hb->trigger[i]) return "trigger";
+        if (memcmp(ha->pktNum + m, hb->pktNum + m, PKTPERPAIR*sizeof(ha->pktNum[0]))) return "pktNum";
+        if (memcmp(ha->pktNSEC + m, hb->pktNSEC + m, PKTPERPAIR*sizeof(ha->pktNSEC[0]))) return "pktNSEC";
+        if (memcmp(ha->tv_sec + m, hb->tv_sec + m, PKTPERPAIR*sizeof(ha->tv_sec[0]))) return "tv_sec";
+        if (memcmp(ha->tv_usec + m, hb->tv_usec + m, PKTPERPAIR*sizeof(ha->tv_usec[0]))) return "tv_usec";
+        if (memcmp(a->stream_block + ha->stream_offset[i], b->stream_block + hb->stream_offset[i],
+                   HSD_modpair_data_size(ha->acqmode[i]))) return "stream data";
+    }
+
+    for (int i = 0; i < ha->coinc_block_size; i++){
+        *record = i;
+        if (ha->coin_acqmode[i] != hb->coin_acqmode[i]) return "coin_acqmode";
+        if (ha->coin_pktNum[i] != hb->coin_pktNum[i]) return "coin_pktNum";
+        if (ha->coin_modNum[i] != hb->coin_modNum[i]) return "coin_modNum";
+        if (ha->coin_quaNum[i] != hb->coin_quaNum[i]) return "coin_quaNum";
+        if (ha->coin_pktUTC[i] != hb->coin_pktUTC[i]) return "coin_pktUTC";
+        if (ha->coin_pktNSEC[i] != hb->coin_pktNSEC[i]) return "coin_pktNSEC";
+        if (ha->coin_tv_sec[i] != hb->coin_tv_sec[i]) return "coin_tv_sec";
+        if (ha->coin_tv_usec[i] != hb->coin_tv_usec[i]) return "coin_tv_usec";
+        if (memcmp(a->coinc_block + ha->coin_offset[i], b->coinc_block + hb->coin_offset[i],
+                   HSD_packet_size(ha->coin_acqmode[i]) - HEADERSIZE)) return "coinc data";
+    }
+
+    for (int i = 0; i < ha->phe_block_size; i++){
+        const int m = i*PKTPERPAIR;
+        *record = i;
+        if (memcmp(ha->phe_modNum + i*2, hb->phe_modNum + i*2, 2*sizeof(ha->phe_modNum[0]))) return "phe_modNum";
+        if (ha->phe_multiplicity[i] != hb->phe_multiplicity[i]) return "phe_multiplicity";
+        if (ha->phe_quabos[i] != hb->phe_quabos[i]) return "phe_quabos";
+        if (ha->phe_pktUTC[i] != hb->phe_pktUTC[i]) return "phe_pktUTC";
+        if (ha->phe_pktNSEC[i] != hb->phe_pktNSEC[i]) return "phe_pktNSEC";
+        if (ha->phe_span[i] != hb->phe_span[i]) return "phe_span";
+        if (memcmp(ha->phe_pktNum + m, hb->phe_pktNum + m, PKTPERPAIR*sizeof(ha->phe_pktNum[0]))) return "phe_pktNum";
+    }
+    *record = -1;
+    return NULL;
+}
+
+/**
+ * Time the assembly of the block.
+ * @return The rate in packets/s
+ */
+static double bench(void (*assemble)(HSD_input_block_t*, HSD_output_block_t*),
+                    HSD_input_block_t* in_block, HSD_output_block_t* out_block, int blocks){
+    uint64_t start = monotonic_ns();
+    for (int b = 0; b < blocks; b++){
+        resetOutputBlock(out_block, 0);
+        assemble(in_block, out_block);
+    }
+    uint64_t elapsed = monotonic_ns() - start;
+    return (double)blocks * in_block->header.data_block_size * 1e9 / elapsed;
+}
+
+/**
+ * Time the assembly of the block over repeated runs.
+ * @return The median rate in packets/s
+ */
+static double benchMedian(void (*assemble)(HSD_input_block_t*, HSD_output_block_t*),
+                          HSD_input_block_t* in_block, HSD_output_block_t* out_block, int blocks, int repeats){
+    vector<double> rates;
+    for (int r = 0; r < repeats; r++){
+        rates.push_back(bench(assemble, in_block, out_block, blocks));
+    }
+    sort(rates.begin(), rates.end());
+    return rates[repeats/2];
+}
+
+int main(int argc, char** argv){
+    int blocks = (argc > 1) ? atoi(argv[1]) : BENCH_BLOCKS;
+    int keepStats = (argc > 2) ? atoi(argv[2]) : 0;
+    int repeats = (argc > 3) ? atoi(argv[3]) : BENCH_REPEATS;
+    if (blocks < 1 || repeats < 1){
+        cerr << "Usage: computeBenchmark [blocks] [pixstats] [repeats]" << endl;
+        return 1;
+    }
+    const struct {
+        const char* name;
+        unsigned char acqmode;
+    } cases[] = {
+        {"16 bit imaging", 0x2},
+        {"8 bit imaging", 0x6},
+        {"PH", 0x1},
+        {"mixed 16/8 bit", 0x0},
+    };
+
+    HSD_input_block_t* in_block = (HSD_input_block_t*)calloc(1, sizeof(HSD_input_block_t));
+    HSD_output_block_t* out_block = (HSD_output_block_t*)calloc(1, sizeof(HSD_output_block_t));
+    HSD_output_block_t* ref_block = (HSD_output_block_t*)calloc(1, sizeof(HSD_output_block_t));
+    if (in_block == NULL || out_block == NULL || ref_block == NULL){
+        cerr << "Unable to allocate the blocks" << endl;
+        return 1;
+    }
+    setupPairs();
+    if (keepStats){
+        pixstats = HSD_pixstats_create(topo->n_modules * QUABOPERMODULE);
+    }
+
+    int failed = 0;
+    printf("Median of %i runs of %i blocks\n", repeats, blocks);
+    printf("%-16s %16s %16s %8s\n", "packets", "storeData pkt/s", "kernel pkt/s", "speedup");
+    for (const auto& c : cases){
+        fillBlock(in_block, c.acqmode);
+
+        //The kernels must write the same output block as storeData
+        int record;
+        assembleOnce(runStoreData, in_block, ref_block);
+        assembleOnce(runKernels, in_block, out_block);
+        const char* field = compareBlocks(ref_block, out_block, &record);
+        if (field != NULL){
+            printf("%-16s the kernels differ from storeData in %s of record %i\n", c.name, field, record);
+            failed = 1;
+            continue;
+        }
+
+        //Warm up the blocks and the assembly state
+        bench(runStoreData, in_block, out_block, blocks/10 + 1);
+        double generic = benchMedian(runStoreData, in_block, out_block, blocks, repeats);
+        bench(runKernels, in_block, out_block, blocks/10 + 1);
+        double kernel = benchMedian(runKernels, in_block, out_block, blocks, repeats);
+        printf("%-16s %16.3e %16.3e %7.2fx\n", c.name, generic, kernel, kernel/generic);
+    }
+
+    free(modulePairs);
+    free(in_block);
+    free(out_block);
+    free(ref_block);
+    return failed;
+}